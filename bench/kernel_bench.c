@@ -0,0 +1,208 @@
+/* Times the row kernels on their own, outside the editor: row_render(),
+ * row_cascade() and row_cursor_rx() run on a row_context of the
+ * benchmark's own, and append() only ever sees the buffers it is given.
+ * Each corpus is loaded into an array of erows owning malloc()ed copies of
+ * their lines, each kernel is run over all of it ROUNDS times, and the
+ * best round is reported in ns per byte of the text it went through, one
+ * tab separated row per corpus and kernel:
+ *
+ *   render      expand tabs and control characters, from scratch
+ *   highlight   carry the comment state down every row with the cascade
+ *               editor_update_syntax() runs, each row handed out as
+ *               never highlighted so none of them is skipped
+ *   cx_to_rx    find the render column of a cursor at the end of each
+ *               row, as editor_evaluate_ry() does
+ *   append      copy each render into a frame buffer with a line
+ *               clear after it */
+
+#define SEDIT_NO_MAIN
+#include "../sedit.c"
+
+#define CORPUS_BYTES (16 << 20)
+#define ROUNDS 5
+#define FRAME_BYTES (64 * 1024)
+
+const char *ascii_lines[] = {
+	"The quick brown fox jumps over the lazy dog near the river bank today.",
+	"Plain text has no tabs and no control characters in it at all, just words.",
+	"Lines of prose run to about seventy characters, the way most text is wrapped.",
+	"Numbers like 42 and 3.14 show up now and then between the words.",
+};
+
+const char *makefile_lines[] = {
+	"all:\t$(TARGETS)\t\t# build everything",
+	"\t$(CC) $(CFLAGS)\t-c $<\t-o $@",
+	"\t\t@echo\t\"linking\t$@\"",
+	"CFLAGS\t:=\t-O2\t-Wall\t-Wextra",
+	"\t\t\tcd $(DIR) && $(MAKE)\t\tinstall",
+	"",
+};
+
+const char *commented_lines[] = {
+	"/* A block comment that opens here",
+	" * and goes on over a few lines, with \"quotes\" and 'x' in it",
+	" * and keywords like int, return and while that don't count. */",
+	"static int parse(const char *s, long n){    /* trailing comment */",
+	"\tfor(long i = 0; i < n; i++){    // a line comment",
+	"\t\tif(s[i] == '*' && s[i + 1] == '/') return -1;    /* nested /* looking */",
+	"\t}",
+	"\treturn 0;    /* one more",
+	"\t   that ends on the next line */ }",
+};
+
+struct corpus{
+	const char *name;
+	char *text;
+	long len;
+	erow *rows;
+	long n;
+};
+
+double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fills c->text with CORPUS_BYTES of the lines repeated. */
+void corpus_from_lines(struct corpus *c, const char **lines, long n){
+	struct appendable_str s = INIT_APPENDABLE_STR
+	for(long x = 0; s.len < CORPUS_BYTES; x++){
+		append(&s, lines[x % n], strlen(lines[x % n]));
+		append(&s, "\n", 1);
+	}
+	c->text = s.buf;
+	c->len = s.len;
+}
+
+/* Lines of bytes where about one in four is a control character. */
+void corpus_binary(struct corpus *c){
+	c->text = malloc(CORPUS_BYTES);
+	if(c->text == NULL) die("malloc");
+	unsigned seed = 2463534242u;
+	for(long i = 0; i < CORPUS_BYTES; i++){
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		char ch = ( seed % 4 == 0 ? (char)((seed >> 8) % 32) : (char)(32 + (seed >> 8) % 224) );
+		c->text[i] = ( i % 97 == 96 ? '\n' : ch == '\n' ? ' ' : ch );
+	}
+	c->len = CORPUS_BYTES;
+}
+
+/* Cuts the text into rows owning copies of their lines. */
+void corpus_split(struct corpus *c){
+	long cap = 1024;
+	c->rows = malloc(sizeof(erow) * cap);
+	if(c->rows == NULL) die("malloc");
+	c->n = 0;
+	for(long i = 0; i < c->len; ){
+		const char *nl = memchr(c->text + i, '\n', c->len - i);
+		long end = ( nl ? nl - c->text : c->len );
+		if(c->n == cap){
+			cap *= 2;
+			c->rows = realloc(c->rows, sizeof(erow) * cap);
+			if(c->rows == NULL) die("realloc");
+		}
+		erow *row = c->rows + c->n++;
+		row->characters = malloc(end - i + 1);
+		if(row->characters == NULL) die("malloc");
+		memcpy(row->characters, c->text + i, end - i);
+		row->characters[end - i] = '\0';
+		row->size = end - i;
+		row->mapped = false;
+		editor_row_init_cache(row);
+		i = end + 1;
+	}
+}
+
+void kernel_render(struct row_context *ctx, struct corpus *c){
+	for(long x = 0; x < c->n; x++){
+		erow *row = c->rows + x;
+		row->gen = 0;
+		if(row->index) row->index->dirty_from = -1;
+		row_render(ctx, row);
+	}
+}
+
+struct corpus_walk{
+	struct corpus *c;
+	long x;
+};
+
+erow *corpus_next(void *arg){
+	struct corpus_walk *w = arg;
+	if(w->x == w->c->n) return NULL;
+	erow *row = w->c->rows + w->x++;
+	row->hl_start_state = -1;
+	return row;
+}
+
+volatile long sink;
+
+void kernel_highlight(struct row_context *ctx, struct corpus *c){
+	struct corpus_walk w = { c, 0 };
+	int state = 0;
+	sink += row_cascade(ctx, corpus_next, &w, &state);
+}
+
+void kernel_cx_to_rx(struct row_context *ctx, struct corpus *c){
+	for(long x = 0; x < c->n; x++)
+		sink += row_cursor_rx(ctx, c->rows + x, c->rows[x].size);
+}
+
+struct appendable_str frame = INIT_APPENDABLE_STR
+
+void kernel_append(struct row_context *ctx, struct corpus *c){
+	(void)ctx;
+	for(long x = 0; x < c->n; x++){
+		if(frame.len > FRAME_BYTES) frame.len = 0;
+		append(&frame, c->rows[x].render, c->rows[x].rsize);
+		append(&frame, CLEAR_LINE, strlen(CLEAR_LINE));
+	}
+}
+
+struct kernel{
+	const char *name;
+	void (*run)(struct row_context *, struct corpus *);
+};
+
+struct kernel kernels[] = {
+	{ "render", kernel_render },
+	{ "highlight", kernel_highlight },
+	{ "cx_to_rx", kernel_cx_to_rx },
+	{ "append", kernel_append },
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+int main(){
+	struct editor_syntax *syntax = &HLDB[0];
+	keyword_table_build(&syntax->keyword_table, syntax->keywords);
+	struct row_context ctx = { .syntax = syntax, .render_gen = 1 };
+
+	struct corpus corpora[4] = { { .name = "ascii" }, { .name = "makefile" },
+		{ .name = "commented_c" }, { .name = "binary" } };
+	corpus_from_lines(&corpora[0], ascii_lines, sizeof(ascii_lines) / sizeof(ascii_lines[0]));
+	corpus_from_lines(&corpora[1], makefile_lines, sizeof(makefile_lines) / sizeof(makefile_lines[0]));
+	corpus_from_lines(&corpora[2], commented_lines, sizeof(commented_lines) / sizeof(commented_lines[0]));
+	corpus_binary(&corpora[3]);
+
+	printf("corpus\tkernel\tbytes\tns_per_byte\n");
+	for(int k = 0; k < 4; k++){
+		struct corpus *c = corpora + k;
+		corpus_split(c);
+		kernel_render(&ctx, c);    // the later kernels start from rendered rows
+		for(unsigned j = 0; j < KERNELS; j++){
+			double best = 0;
+			for(int round = 0; round < ROUNDS; round++){
+				double start = now_ns();
+				kernels[j].run(&ctx, c);
+				double t = now_ns() - start;
+				if(round == 0 || t < best) best = t;
+			}
+			printf("%s\t%s\t%ld\t%.3f\n", c->name, kernels[j].name, c->len, best / c->len);
+		}
+	}
+	return 0;
+}
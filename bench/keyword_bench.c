@@ -0,0 +1,121 @@
+/* Times the compiled keyword table against the strncmp loop it replaced,
+ * over every token start of a synthetic C corpus, and checks that both
+ * agree on every token. */
+
+#define SEDIT_NO_MAIN
+#include "../sedit.c"
+
+#define CORPUS_LINES 200000
+#define ROUNDS 5
+
+const char *corpus_lines[] = {
+	"static int editor_read_key(struct config *st, long count){",
+	"\tfor(long y = 0; y < row->size; y++){",
+	"\t\tif(seq[y] == '\\t') tabs++;",
+	"\t\telse if(ch <= 31) continue;",
+	"\treturn (unsigned char)value + offset * 2;",
+	"#include <stdio.h>",
+	"typedef struct erow erow;",
+	"\twhile(left_total < at && right != NULL) node = node->right;",
+	"\tconst char *name = \"signed\"; double ratio = 0.5;",
+	"\tswitch(key){ case ARROW_UP: break; default: return -1; }",
+};
+
+#define CORPUS_TEMPLATES (sizeof(corpus_lines) / sizeof(corpus_lines[0]))
+
+/* The matcher row_highlight() used before the keyword table. */
+int legacy_keyword(char **keywords, const char *s, int *len){
+	char **kws = keywords;
+	int kw_len;
+	bool is_keyword_2;
+	while(*kws){
+		kw_len = strlen(*kws);
+		is_keyword_2 = (*kws)[kw_len - 1] == '|';
+		if(is_keyword_2) kw_len--;
+		if(! strncmp(*kws, s, kw_len) && is_separator(s[kw_len])) break;
+		kws++;
+	}
+	if(*kws == NULL) return HL_NORMAL;
+	*len = kw_len;
+	return is_keyword_2 ? HL_KEYWORD_2 : HL_KEYWORD_1;
+}
+
+int table_keyword(struct keyword_table *t, const char *s, int *len){
+	int kw_len = 0;
+	while(kw_len <= t->max_len && s[kw_len] && !is_separator(s[kw_len])) kw_len++;
+	int hl = keyword_table_lookup(t, s, kw_len);
+	if(hl != HL_NORMAL) *len = kw_len;
+	return hl;
+}
+
+double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(){
+	struct editor_syntax *syntax = &HLDB[0];
+	keyword_table_build(&syntax->keyword_table, syntax->keywords);
+
+	size_t corpus_len = 0;
+	for(long x = 0; x < CORPUS_LINES; x++)
+		corpus_len += strlen(corpus_lines[x % CORPUS_TEMPLATES]) + 1;
+
+	char *corpus = malloc(corpus_len + 1);
+	char *p = corpus;
+	for(long x = 0; x < CORPUS_LINES; x++){
+		const char *line = corpus_lines[x % CORPUS_TEMPLATES];
+		size_t len = strlen(line);
+		memcpy(p, line, len);
+		p[len] = '\n';
+		p += len + 1;
+	}
+	*p = '\0';
+
+	// token starts are the positions the highlighter tries keywords at
+	long ntokens = 0;
+	long *tokens = malloc(sizeof(long) * corpus_len);
+	for(size_t y = 0; y < corpus_len; y++)
+		if(y == 0 || is_separator(corpus[y - 1])) tokens[ntokens++] = y;
+
+	long mismatches = 0, matches = 0;
+	for(long t = 0; t < ntokens; t++){
+		int legacy_len = 0, table_len = 0;
+		int a = legacy_keyword(syntax->keywords, corpus + tokens[t], &legacy_len);
+		int b = table_keyword(&syntax->keyword_table, corpus + tokens[t], &table_len);
+		if(a != b || legacy_len != table_len) mismatches++;
+		matches += a != HL_NORMAL;
+	}
+
+	double best_legacy = 0, best_table = 0;
+	volatile long sink = 0;
+	for(int round = 0; round < ROUNDS; round++){
+		double start = now_ns();
+		for(long t = 0; t < ntokens; t++){
+			int len = 0;
+			sink += legacy_keyword(syntax->keywords, corpus + tokens[t], &len);
+		}
+		double legacy = now_ns() - start;
+
+		start = now_ns();
+		for(long t = 0; t < ntokens; t++){
+			int len = 0;
+			sink += table_keyword(&syntax->keyword_table, corpus + tokens[t], &len);
+		}
+		double table = now_ns() - start;
+
+		if(round == 0 || legacy < best_legacy) best_legacy = legacy;
+		if(round == 0 || table < best_table) best_table = table;
+	}
+
+	printf("tokens       %ld (%ld keywords)\n", ntokens, matches);
+	printf("strncmp loop %.2f ns/token\n", best_legacy / ntokens);
+	printf("hash table   %.2f ns/token\n", best_table / ntokens);
+	printf("speedup      %.1fx\n", best_legacy / best_table);
+	if(mismatches) printf("MISMATCHES   %ld\n", mismatches);
+
+	free(tokens);
+	free(corpus);
+	return mismatches != 0;
+}
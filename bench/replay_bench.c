@@ -0,0 +1,310 @@
+/* Replays keystroke traces through editor_process_keypress() and
+ * editor_refresh_screen() on synthetic files and reports, for each kind of
+ * operation, its latency and the bytes of the frame drawn after it.
+ *
+ * Keys are fed through a pipe standing in for the terminal and frames go
+ * to /dev/null. Each trace runs against each file in a child of its own,
+ * so every run starts from a freshly opened file and its peak RSS is its
+ * own. Results are printed as tab separated rows under a header, one row
+ * per file, trace and operation, so runs can be compared across commits.
+ *
+ *   replay_bench [file...]      files are 1k 1m 10m long, all by default
+ *
+ * Traces are read from the traces directory next to the binary. Each line
+ * is an operation name, a repeat count and the keys, tab separated, with
+ * \r \n \t \e \\ and \xHH escapes. An operation is timed from its first key
+ * until the frame after its last one is written; operations named - are
+ * replayed but not timed. The keys of one operation must leave the editor
+ * waiting for a new key, not in the middle of a prompt. */
+
+#define SEDIT_NO_MAIN
+#include "../sedit.c"
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define BENCH_SCREEN_ROWS 50
+#define BENCH_SCREEN_COLS 160
+#define BENCH_OP_MAX 4096
+#define BENCH_LONG_LINE (256 * 1024)
+
+struct bench_file{
+	const char *name;
+	long lines;     // 0 for the long line file
+};
+
+struct bench_file bench_files[] = {
+	{ "1k", 1000 },
+	{ "1m", 1000000 },
+	{ "10m", 10000000 },
+	{ "long", 0 },
+};
+
+#define BENCH_FILES (sizeof(bench_files) / sizeof(bench_files[0]))
+
+const char *corpus_lines[] = {
+	"static int editor_read_key(struct config *st, long count){",
+	"\tfor(long y = 0; y < row->size; y++){",
+	"\t\tif(seq[y] == '\\t') tabs++;    /* count the tabs */",
+	"\t\telse if(ch <= 31) continue;",
+	"\treturn (unsigned char)value + offset * 2;",
+	"/* A comment that runs",
+	" * over a few lines. */",
+	"#include <stdio.h>",
+	"\tconst char *name = \"signed\"; double ratio = 0.5;",
+	"}",
+};
+
+#define CORPUS_TEMPLATES (sizeof(corpus_lines) / sizeof(corpus_lines[0]))
+
+struct bench_op{
+	char name[64];
+	long repeat;
+	char keys[BENCH_OP_MAX];
+	long len;
+};
+
+struct bench_trace{
+	char name[256];
+	struct bench_op *ops;
+	long n;
+};
+
+double now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Writes the synthetic file `f` to path. */
+void bench_write_file(const struct bench_file *f, const char *path){
+	FILE *out = fopen(path, "w");
+	if(out == NULL) die(path);
+	if(f->lines){
+		for(long x = 0; x < f->lines; x++){
+			fputs(corpus_lines[x % CORPUS_TEMPLATES], out);
+			fputc('\n', out);
+		}
+	}
+	else{
+		// 64 lines of BENCH_LONG_LINE bytes of the corpus run together
+		for(long x = 0; x < 64; x++){
+			long len = 0;
+			for(long k = 0; len < BENCH_LONG_LINE; k++){
+				const char *s = corpus_lines[k % CORPUS_TEMPLATES];
+				fputs(s, out);
+				fputc(' ', out);
+				len += strlen(s) + 1;
+			}
+			fputc('\n', out);
+		}
+	}
+	if(fclose(out) != 0) die(path);
+}
+
+long bench_unescape(const char *s, char *to, long cap){
+	long n = 0;
+	while(*s && n < cap){
+		char c = *s++;
+		if(c == '\\' && *s){
+			c = *s++;
+			if(c == 'r') c = '\r';
+			else if(c == 'n') c = '\n';
+			else if(c == 't') c = '\t';
+			else if(c == 'e') c = ESC;
+			else if(c == 'x' && isxdigit((unsigned char)s[0]) && isxdigit((unsigned char)s[1])){
+				char hex[3] = { s[0], s[1], '\0' };
+				c = strtol(hex, NULL, 16);
+				s += 2;
+			}
+		}
+		to[n++] = c;
+	}
+	return n;
+}
+
+bool bench_read_trace(const char *path, struct bench_trace *t){
+	FILE *in = fopen(path, "r");
+	if(in == NULL) return false;
+	char *line = NULL;
+	size_t cap = 0;
+	long len, cap_ops = 0;
+	t->ops = NULL;
+	t->n = 0;
+	while((len = getline(&line, &cap, in)) != -1){
+		while(len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+		if(len == 0 || line[0] == '#') continue;
+
+		char *repeat = strchr(line, '\t');
+		char *keys = ( repeat ? strchr(repeat + 1, '\t') : NULL );
+		if(keys == NULL){
+			fprintf(stderr, "%s: bad line: %s\n", path, line);
+			exit(1);
+		}
+		*repeat++ = *keys++ = '\0';
+
+		if(t->n == cap_ops){
+			cap_ops = cap_ops ? cap_ops * 2 : 8;
+			t->ops = realloc(t->ops, sizeof(struct bench_op) * cap_ops);
+			if(t->ops == NULL) die("realloc");
+		}
+		struct bench_op *op = t->ops + t->n++;
+		snprintf(op->name, sizeof(op->name), "%s", line);
+		op->repeat = atol(repeat);
+		op->len = bench_unescape(keys, op->keys, sizeof(op->keys));
+	}
+	free(line);
+	fclose(in);
+	return true;
+}
+
+/* Sets the editor up as init_editor() would for a BENCH_SCREEN_ROWS by
+ * BENCH_SCREEN_COLS terminal whose input is the read end of keys. */
+void bench_init_editor(int keys){
+	if(dup2(keys, STDIN_FILENO) == -1) die("dup2");
+	int null = open("/dev/null", O_WRONLY);
+	if(null == -1 || dup2(null, STDOUT_FILENO) == -1) die("/dev/null");
+	close(null);
+
+	init_editor_state();
+	St.screen_rows = BENCH_SCREEN_ROWS - 2;
+	St.screen_cols = BENCH_SCREEN_COLS;
+	editor_init_events();
+	St.synchronized_output = true;
+	screen_init_sgr();
+}
+
+/* Hands the editor keys and runs it until it has taken all of them and
+ * drawn the frame after them. */
+void bench_replay(int to_editor, int from_keys, const char *keys, long len){
+	if(write_all(to_editor, keys, len) == -1) die("write");
+	while(1){
+		int queued = 0;
+		if(St.input.len == 0 && (ioctl(from_keys, FIONREAD, &queued) == -1 || queued == 0)) break;
+		editor_process_keypress();
+	}
+	editor_refresh_screen();
+}
+
+int bench_cmp(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return ( x > y ) - ( x < y );
+}
+
+double bench_percentile(double *v, long n, int p){
+	long i = n * p / 100;
+	return v[i < n ? i : n - 1];
+}
+
+/* Runs trace t on the file at path and prints a row for each timed op. */
+void bench_run(const char *file, const char *path, const struct bench_trace *t, FILE *out){
+	int keys[2];
+	if(pipe(keys) == -1) die("pipe");
+	bench_init_editor(keys[0]);
+	editor_open(path);
+	St.undo.on = true;
+	editor_refresh_screen();
+
+	for(long k = 0; k < t->n; k++){
+		const struct bench_op *op = t->ops + k;
+		double *ns = malloc(sizeof(double) * (op->repeat + 1));
+		double *bytes = malloc(sizeof(double) * (op->repeat + 1));
+		if(ns == NULL || bytes == NULL) die("malloc");
+		for(long r = 0; r < op->repeat; r++){
+			double start = now_ns();
+			bench_replay(keys[1], keys[0], op->keys, op->len);
+			ns[r] = now_ns() - start;
+			bytes[r] = St.out.len;
+		}
+
+		if(strcmp(op->name, "-") != 0 && op->repeat > 0){
+			qsort(ns, op->repeat, sizeof(double), bench_cmp);
+			qsort(bytes, op->repeat, sizeof(double), bench_cmp);
+			struct rusage ru;
+			getrusage(RUSAGE_SELF, &ru);
+			fprintf(out, "%s\t%s\t%s\t%ld\t%.1f\t%.1f\t%.1f\t%.0f\t%.0f\t%ld\n",
+					file, t->name, op->name, op->repeat,
+					bench_percentile(ns, op->repeat, 50) / 1e3,
+					bench_percentile(ns, op->repeat, 99) / 1e3,
+					ns[op->repeat - 1] / 1e3,
+					bench_percentile(bytes, op->repeat, 50),
+					bytes[op->repeat - 1],
+					ru.ru_maxrss);
+			fflush(out);
+		}
+		free(ns);
+		free(bytes);
+	}
+}
+
+int bench_trace_cmp(const void *a, const void *b){
+	return strcmp(((const struct bench_trace *)a)->name, ((const struct bench_trace *)b)->name);
+}
+
+int main(int argc, char *argv[]){
+	// the traces live next to the binary
+	char *traces_dir = malloc(strlen(argv[0]) + 16);
+	if(traces_dir == NULL) die("malloc");
+	const char *slash = strrchr(argv[0], '/');
+	sprintf(traces_dir, "%.*straces", ( slash ? (int)(slash - argv[0] + 1) : 0 ), argv[0]);
+
+	DIR *dir = opendir(traces_dir);
+	if(dir == NULL) die(traces_dir);
+	struct bench_trace traces[64];
+	long ntraces = 0;
+	struct dirent *e;
+	while((e = readdir(dir)) && ntraces < 64){
+		long len = strlen(e->d_name);
+		if(len < 6 || strcmp(e->d_name + len - 5, ".keys") != 0) continue;
+		char path[4096];
+		snprintf(path, sizeof(path), "%s/%s", traces_dir, e->d_name);
+		struct bench_trace *t = traces + ntraces;
+		if(!bench_read_trace(path, t)) die(path);
+		snprintf(t->name, sizeof(t->name), "%.*s", (int)(len - 5), e->d_name);
+		ntraces++;
+	}
+	closedir(dir);
+	qsort(traces, ntraces, sizeof(struct bench_trace), bench_trace_cmp);
+
+	const char *tmp = getenv("TMPDIR");
+	char work[1024];
+	snprintf(work, sizeof(work), "%s/sedit-bench-XXXXXX", tmp ? tmp : "/tmp");
+	if(mkdtemp(work) == NULL) die("mkdtemp");
+
+	// stdout is the frames' null sink in the children, so rows go out on a copy
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	if(out == NULL) die("fdopen");
+	fprintf(out, "file\ttrace\top\tn\tp50_us\tp99_us\tmax_us\tframe_bytes_p50\tframe_bytes_max\tpeak_rss_kb\n");
+	fflush(out);
+
+	int status = 0;
+	for(unsigned f = 0; f < BENCH_FILES; f++){
+		bool wanted = argc < 2;
+		for(int a = 1; a < argc; a++) wanted |= strcmp(argv[a], bench_files[f].name) == 0;
+		if(!wanted) continue;
+
+		char path[sizeof(work) + 16];
+		snprintf(path, sizeof(path), "%s/%s.c", work, bench_files[f].name);
+		for(long k = 0; k < ntraces; k++){
+			bench_write_file(bench_files + f, path);    // saving changes it
+			pid_t pid = fork();
+			if(pid == -1) die("fork");
+			if(pid == 0){
+				bench_run(bench_files[f].name, path, traces + k, out);
+				_exit(0);
+			}
+			int child;
+			if(waitpid(pid, &child, 0) == -1 || !WIFEXITED(child) || WEXITSTATUS(child) != 0){
+				fprintf(stderr, "%s on %s failed\n", traces[k].name, bench_files[f].name);
+				status = 1;
+			}
+		}
+		unlink(path);
+		char *journal = journal_path(path);
+		unlink(journal);
+		free(journal);
+	}
+	rmdir(work);
+	return status;
+}
@@ -18,10 +18,20 @@
 #include <sys/types.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 #define SEDIT_TAB_STOP 4
+#define ROW_CHECKPOINT_STRIDE 128
+#define SEDIT_RENDER_PREFETCH 16
 
 #define CLEAR_LINE "\x1b[K"
 #define CLEAR_SCREEN_ESQ "\x1b[2J"
@@ -31,11 +41,25 @@
 #define MOVE_CURSOR_TO_BOTTOM_RIGHT_ESQ "\x1b[999C\x1b[999B"
 #define HIDE_CURSOR_ESQ "\x1b[?25l"
 #define SHOW_CURSOR_ESQ "\x1b[?25h"
+#define BEGIN_SYNCHRONIZED_UPDATE_ESQ "\x1b[?2026h"
+#define END_SYNCHRONIZED_UPDATE_ESQ "\x1b[?2026l"
+#define ENABLE_BRACKETED_PASTE_ESQ "\x1b[?2004h"
+#define DISABLE_BRACKETED_PASTE_ESQ "\x1b[?2004l"
+#define PASTE_END_ESQ "\x1b[201~"
 #define INVERT_COLOR_ESQ "\x1b[7m"
 #define NORMAL_COLOR_ESQ "\x1b[m"
 #define RED_CHARACTER_ESQ "\x1b[31m"
 #define DEFAULT_CHARACTER_ESQ "\x1b[39m"
 #define CHANGE_COLOR_FORMAT_ESQ "\x1b[%dm"
+#define SET_SCROLL_REGION_FORMAT_ESQ "\x1b[1;%ldr"
+#define RESET_SCROLL_REGION_ESQ "\x1b[r"
+#define SCROLL_UP_FORMAT_ESQ "\x1b[%ldS"
+#define SCROLL_DOWN_FORMAT_ESQ "\x1b[%ldT"
+
+#define TERMINAL_REPLY_TIMEOUT_MS 100
+#define ESC_SEQUENCE_TIMEOUT_MS 50
+#define STATUS_MESSAGE_TIMEOUT_MS 5000
+#define PASTE_TIMEOUT_MS 1000
 
 #define CLEAR_SCREEN() write(STDOUT_FILENO, CLEAR_SCREEN_ESQ, 4)
 #define REPOSITION_CURSOR() write(STDOUT_FILENO, MOVE_CURSOR_TO_TOP_LEFT_ESQ, 3)
@@ -65,36 +89,309 @@ enum editor_key {
 	PAGE_DOWN,
 	HOME,
 	END,
-	DEL_KEY
+	DEL_KEY,
+	PASTE_START
+};
+
+struct lex_state{
+	bool is_prev_sep;
+	char inside_string;
+	char inside_comment;
+};
+
+/* A point in a long row where rendering and lexing can pick up again. */
+struct row_checkpoint{
+	long c, r;    // a character and the render index it starts at
+	bool lexed;   // the lexer stopped at r, and st, prev_hl and prev_ch are what it saw
+	struct lex_state st;
+	unsigned char prev_hl;
+	char prev_ch;
+};
+
+/* Render state kept only for rows of ROW_CHECKPOINT_STRIDE characters or
+ * more, so short rows don't pay for it. */
+struct row_index{
+	struct row_checkpoint *ckpt;   // every ROW_CHECKPOINT_STRIDE characters
+	long nckpt;
+	long last_tab;    // no tab comes after this character, -1 if there is none
+	long dirty_from, dirty_end;    // characters edited since the render, dirty_from -1 if unknown
+	long dirty_shift;              // characters added past dirty_end
+	unsigned dirty_gen;
 };
 
 struct erow{
-	long idx;
-	long size;
 	char *characters;
+	char *render;     // characters itself when render_alias is set
+	unsigned char *hl;    // two cells a byte, see hl_get(); NULL when every cell is HL_NORMAL
+	struct row_index *index;
+	long size;
 	long rsize;
-	char *render;
-	unsigned char *hl;
-	int hl_open_comment;
+	unsigned gen;   // St.rc.render_gen when render and hl were built, 0 if stale
+	char hl_start_state;   // lexer state at the start of the row
+	char hl_open_comment;  // lexer state at the end of the row
+	bool mapped;    // characters point into St.map and must not be written
+	bool render_alias;    // the row renders as itself, so render was not copied
 };
 
 typedef struct erow erow;
 
+struct file_map{
+	char *data;
+	size_t size;
+	long lines;
+	size_t *line_start;
+	signed char *comment_state;   // see map_comment_state()
+	bool detached;                // see map_detach()
+};
+
+/* Grows geometrically; St.out is kept and reused for every frame. */
+struct appendable_str{
+	char *buf;
+	long len;
+	long cap;
+};
+#define INIT_APPENDABLE_STR { NULL, 0, 0 };
+
+#define SCREEN_ATTR_INVERT 0x80
+
+struct screen_line{
+	char *chars;
+	unsigned char *attrs;
+	long len, cap;
+};
+
+struct screen_frame{
+	struct screen_line *lines;
+	long rows, cols;
+	long row_offset, col_offset;
+	bool valid;   // false when the terminal contents are unknown
+};
+
+struct sgr_esq{
+	char seq[12];
+	int len;
+};
+
+struct input_queue{
+	char buf[4096];
+	int start, len;
+};
+
+enum editor_timer{
+	TIMER_STATUS_MESSAGE,
+	TIMER_JOURNAL,
+	TIMER_COUNT
+};
+
+struct lex_resume{
+	erow *row;    // row whose hl is valid before checkpoint k
+	long k;
+	long converge;    // first checkpoint whose recorded state still describes the old hl
+};
+
+/* What rendering and lexing a row read besides the row itself. The editor
+ * runs them with St.rc; a benchmark can keep its own. */
+struct row_context{
+	struct editor_syntax *syntax;
+	unsigned render_gen;      // rows rendered under it are current while this holds
+	struct appendable_str render_tmp;     // scratch for partial renders
+	struct lex_resume lex_resume;
+};
+
+/* Row text is carved out of slabs by size class, see text_alloc(). */
+#define TEXT_CLASSES 17
+
+struct text_arena{
+	char *slab;     // slab blocks are being carved from
+	long used;      // bytes of it handed out
+	char *free[TEXT_CLASSES];    // freed blocks of each class
+	long slabs;     // slabs allocated so far
+	long big;       // bytes in blocks too big for a class
+};
+
+struct search_pattern{
+	char *needle;
+	long len;
+	bool horspool;
+	long shift[256];    // Horspool shift for each byte under the needle's last position
+	struct regex *re;   // the needle compiled, for regex searches
+	const char *error;  // why the needle didn't compile as a regex
+};
+
+struct search_match{
+	long line, at;
+};
+
+/* Where the text of a run of rows lives, copied out of the row tree so
+ * that search workers never walk it. */
+struct search_segment{
+	long first, lines;
+	erow *rows;    // NULL for rows still in the mapping
+	long file_line;
+};
+
+/* A run of rows searched by one worker. */
+struct search_job{
+	long seg;             // segment holding row `first`
+	long first, lines;
+	struct search_match *matches;
+	long n, cap;
+	long count;           // matches found, stored or not
+	bool done;
+};
+
+#define SEARCH_MAX_THREADS 8
+
+/* A search runs as jobs taken in order by a pool of workers. Finished jobs
+ * are merged in row order into index, which therefore always holds every
+ * match in rows [0, covered). */
+struct search{
+	struct search_pattern pattern;
+	bool regex;           // queries are regular expressions
+	struct regex_matcher *matcher;    // for pattern.re on the UI thread
+	bool active;          // the search prompt is up
+	struct search_segment *segs;
+	long nsegs;
+	struct search_job *jobs;
+	long njobs, jobs_cap;
+	pthread_t threads[SEARCH_MAX_THREADS];
+	int nthreads;
+	pthread_mutex_t lock;     // guards next_job to cancel and each job's done
+	long next_job;
+	long total;           // matches counted by finished jobs
+	long stored;          // matches stored by finished jobs
+	bool cancel;
+	long merged;          // jobs merged into index
+	bool truncated;       // index hit SEARCH_MAX_MATCHES and stopped growing
+	struct search_match *index;
+	long n, cap;
+	long covered;
+	long line, at;        // the match shown, line -1 if none
+	long k;               // its place in index, -1 if it is not in it
+	int pending;          // direction of a move waiting for more of the index
+	long hl_line;         // row whose hl has the match marked, -1 if none
+	unsigned char *saved_hl;    // that row's hl before, NULL if it had none
+};
+
+/* Edits since the last save, logged for recovery after a crash. See the
+ * journal section. */
+struct journal{
+	bool on;              // edits are being logged
+	char *path;
+	struct appendable_str buf;      // records not handed to the writer yet
+	char pend_op;         // 'i' or 'd' record still being added to, or 0
+	long pend_line, pend_at, pend_len;
+	struct appendable_str pend_text;
+	pthread_t writer;
+	bool writer_running;
+	bool warned;          // the user was told the journal failed
+	pthread_mutex_t lock;     // guards the rest, which the writer uses
+	pthread_cond_t wake, idle;
+	struct appendable_str out;      // records handed to the writer
+	int fd;               // -1 until the writer opens the file
+	bool append;          // open it without emptying it
+	bool busy;            // the writer is writing
+	bool failed;          // a write failed, so the file can't be trusted
+};
+
+/* An edit as the undo log keeps it. See the undo section. */
+enum undo_kind{
+	UNDO_INSERT,      // len characters inserted into a row at `at`
+	UNDO_DELETE,      // text, len characters, deleted from a row at `at`
+	UNDO_ROWS_IN,     // n rows inserted at line
+	UNDO_ROWS_OUT,    // a row deleted at line
+	UNDO_SET          // the text of a row replaced
+};
+
+struct undo_op{
+	unsigned char kind;
+	bool first;       // the op starts a group that is undone as a unit
+	bool backward;    // an UNDO_DELETE grown by backspacing, text is last character first
+	bool mapped;      // text points into St.map
+	long line, at, len;
+	long n;           // rows, for the row ops
+	long cost;        // bytes held by text and rows
+	char *text;       // text the op needs that isn't in the buffer, or NULL
+	struct row_piece *rows;     // more than one row taken out of the buffer
+};
+
+struct undo_log{
+	bool on;
+	bool replaying;   // edits being made come from the log, so aren't recorded
+	bool open;        // edits join the group of the last op
+	bool merge;       // the last op was one keystroke, the next may fold into it
+	bool overflow;    // the group being recorded outgrew the budget and was dropped
+	struct undo_op *ops;
+	long n, cap;
+	long cur;         // ops[0, cur) are done, ops[cur, n) can be redone
+	long start;       // ops dropped from the front so far
+	long saved;       // start + cur when the file was saved, -1 if no longer reachable
+	long bytes;       // held by the log, counted against budget
+	long budget;
+};
+
+/* Counters for the diagnostics overlay. See the stats section. */
+struct stats{
+	bool shown;           // the overlay takes the place of the status message
+	long long frame_ns;   // to build the last frame
+	long long worst_frame_ns;
+	long frame_bytes;     // written for the last frame
+	long key_hl, key_cascade;         // rows highlighted since the last key, and how many of them by cascade
+	long last_key_hl, last_key_cascade;   // the same for the key before
+	long arena_calls;     // text_alloc() and text_free() calls
+	long frame_allocs, frame_arena;   // heap and arena calls between the last two frames
+	long allocs_at_frame, arena_at_frame;
+};
+
+struct gap_buffer{
+	erow *row;    // row holding the gap, or NULL
+	long at, len;
+};
+
 struct config{
 	struct termios orig_termios;
 	long screen_rows, screen_cols;
 	long cx, cy, ry;
 	long num_rows;
 	long row_offset, col_offset;
-	erow *rows;
+	struct row_piece *rows;
+	struct gap_buffer gap;
+	struct text_arena text;
+	struct search search;
+	struct journal journal;
+	struct undo_log undo;
+	struct stats stats;
+	struct file_map map;
+	struct screen_frame front, back;
+	struct appendable_str out;
+	bool synchronized_output;
 	char *file_name;
-	struct editor_syntax *syntax;
+	struct row_context rc;
+	long hl_dirty_from;   // first row whose comment state may be out of date
+	long hl_dirty_to;     // and the last; see editor_syntax_dirty()
 	char status_msg[80];
-	time_t status_msg_time;
+	struct input_queue input;
+	int winch_pipe[2];    // written by the SIGWINCH handler
+	int wake_pipe[2];     // written by background work with news for the UI
+	long long timers[TIMER_COUNT];    // monotonic deadlines in ms, 0 when not armed
 	size_t modified;
 	bool quit_pressed_last;
 };
 
+struct keyword_slot{
+	const char *word;
+	int len;
+	int hl;
+};
+
+struct keyword_table{
+	struct keyword_slot *slots;
+	unsigned mask;
+	unsigned seed;
+	bool full_hash;
+	int max_len;
+};
+
 struct editor_syntax {
 	char *file_type;
 	char **file_match;
@@ -103,6 +400,7 @@ struct editor_syntax {
 	char *multiline_comment_start;
 	char *multiline_comment_end;
 	int flags;
+	struct keyword_table keyword_table;   // built from keywords on first use
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
@@ -121,6 +419,48 @@ void die(const char *s) {
 
 struct config St;    // St for state/settings
 
+/* Hot paths count what the diagnostics overlay shows with STAT_ADD().
+ * The editor's heap calls go through xmalloc() and friends, which count
+ * with STAT_ALLOC() on the thread making them, since search and indexing
+ * workers allocate too. Building with SEDIT_STATS set to 0 compiles all
+ * of the counting out. */
+
+#ifndef SEDIT_STATS
+#define SEDIT_STATS 1
+#endif
+
+#if SEDIT_STATS
+__thread long stats_allocs;    // xmalloc(), xcalloc(), xrealloc() and xfree() calls
+
+#define STAT_ADD(field, n) (St.stats.field += (n))
+#define STAT_ALLOC() (stats_allocs++)
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_ALLOC() ((void)0)
+#endif
+
+void *xmalloc(size_t n){
+	STAT_ALLOC();
+	return malloc(n);
+}
+
+void *xcalloc(size_t n, size_t size){
+	STAT_ALLOC();
+	return calloc(n, size);
+}
+
+void *xrealloc(void *p, size_t n){
+	STAT_ALLOC();
+	return realloc(p, n);
+}
+
+void xfree(void *p){
+	STAT_ALLOC();
+	free(p);
+}
+
+struct sgr_esq screen_sgr[SCREEN_ATTR_INVERT + 1];    // indexed by cell attribute
+
 const char *name_ascii_art[]=  
 
  {  "   ███████    ███████ ██████  ██ ████████ ",
@@ -147,6 +487,7 @@ struct editor_syntax HLDB[] = { {
 		C_HL_keywords,
 		"//", "/*", "*/",
 		HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+		{ 0 },
 	}
 };
 
@@ -156,375 +497,3795 @@ struct editor_syntax HLDB[] = { {
 
 void editor_set_status_message(const char *format, ...);
 void editor_refresh_screen();
-char* editor_prompt(const char *format, void (*callback)(char *,int));
-void editor_update_syntax(erow *);
+char* editor_prompt(const char *format, void (*callback)(char *,int), bool allow_empty);
+void editor_update_syntax(long);
+void editor_update_row(long);
+erow *editor_row_rendered(long);
+void editor_syntax_catch_up(long);
+void editor_syntax_dirty(long, long);
 int editor_syntax_to_color(int); 
 void editor_evaluate_ry();
 void editor_select_syntax_highlight();
+void editor_init_events();
+void editor_timer_set(int, long);
+void editor_timer_cancel(int);
+void input_read_paste(struct appendable_str *);
+void editor_gap_close();
+int editor_row_runs(erow *, const char **, long *);
+void editor_row_init_cache(erow *);
+void append(struct appendable_str *, const char *, long);
+long row_lex_lookahead(const struct row_context *);
+void screen_init_sgr();
+void editor_wake();
+int editor_read_key();
+long long monotonic_ms();
+long long monotonic_ns();
+void journal_insert(long, long, const char *, long);
+void journal_delete(long, long, long);
+void journal_row(char, long, const char *, long);
+void journal_commit();
+void journal_start(bool);
+void journal_discard();
+void journal_recover();
+void undo_insert(long, long, long);
+void undo_delete(long, long, long);
+void undo_rows_in(long, long);
+void undo_row_out(long, erow *);
+bool undo_set(long, erow *);
+void undo_saved();
+
+/* --- file mapping --- */
+
+/* Files are opened by mapping them read-only and indexing where each line
+ * starts. Lines that are never touched are read straight out of the
+ * mapping and never copied, so the file under it must never be unlinked
+ * or cut short while rows point into it: saving renames a new file over
+ * it, and only writes over it in place after map_detach(). */
+
+#define MAP_INDEX_MAX_THREADS 8
+#define MAP_INDEX_MIN_CHUNK (1 << 20)
+
+struct map_index_job{
+	const char *data;
+	size_t begin, end;
+	size_t *starts;
+	long count, cap;
+	bool failed;
+	bool threaded;
+	pthread_t thread;
+};
 
-/* --- ROW OPERATIONS --- */
-
-bool cursor_below_last_line(){
-	return St.cx == St.num_rows;
+void *map_index_worker(void *arg){
+	struct map_index_job *job = arg;
+	const char *p = job->data + job->begin;
+	const char *end = job->data + job->end;
+
+	while(p < end){
+		const char *nl = memchr(p, '\n', end - p);
+		if(nl == NULL) break;
+		if(job->count == job->cap){
+			job->cap = job->cap ? job->cap * 2 : 1024;
+			size_t *starts = xrealloc(job->starts, sizeof(size_t) * job->cap);
+			if(starts == NULL){
+				job->failed = true;
+				break;
+			}
+			job->starts = starts;
+		}
+		job->starts[job->count++] = nl + 1 - job->data;
+		p = nl + 1;
+	}
+	return NULL;
 }
 
-void editor_update_row(erow *row){
-	long tabs = 0, ctrls = 0, misellanous = 0;
-	char *seq = row->characters;
-
-	for(long y = 0; y < row->size; y++){
-		tabs += seq[y] == '\t';
-		ctrls += (0 <= seq[y] && seq[y] <= 26);
-		misellanous += (28 <= seq[y] && seq[y] <= 31);
+/* Splits the mapping into chunks and collects the newline offsets of each
+ * chunk on its own thread, then stitches the per-chunk lists together. */
+int map_build_index(){
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > MAP_INDEX_MAX_THREADS) nthreads = MAP_INDEX_MAX_THREADS;
+	if(nthreads > (long)(St.map.size / MAP_INDEX_MIN_CHUNK))
+		nthreads = St.map.size / MAP_INDEX_MIN_CHUNK;
+	if(nthreads < 1) nthreads = 1;
+
+	struct map_index_job jobs[MAP_INDEX_MAX_THREADS];
+	size_t chunk = St.map.size / nthreads;
+
+	for(long t = 0; t < nthreads; t++){
+		jobs[t].data = St.map.data;
+		jobs[t].begin = t * chunk;
+		jobs[t].end = ( t == nthreads - 1 ? St.map.size : (t + 1) * chunk );
+		jobs[t].starts = NULL;
+		jobs[t].count = jobs[t].cap = 0;
+		jobs[t].failed = false;
+		jobs[t].threaded = false;
+	}
+	for(long t = 1; t < nthreads; t++)
+		jobs[t].threaded = pthread_create(&jobs[t].thread, NULL, map_index_worker, jobs + t) == 0;
+	for(long t = 0; t < nthreads; t++){
+		if(jobs[t].threaded) pthread_join(jobs[t].thread, NULL);
+		else map_index_worker(jobs + t);
 	}
 
-	free(row->render);
-	row->render = malloc(row->size + tabs*(SEDIT_TAB_STOP - 1) + ctrls + misellanous + 1);
+	bool failed = false;
+	long lines = 1;
+	for(long t = 0; t < nthreads; t++){
+		failed |= jobs[t].failed;
+		lines += jobs[t].count;
+	}
 
-	long y;
-	long idx = 0;
-	for(y = 0; y < row->size; y++){
-		if(seq[y] == '\t'){
-			do{
-				row->render[idx++] = ' ';
-			} while(idx % SEDIT_TAB_STOP);
-		}
-		else if(0 <= seq[y] && seq[y] <= 26){
-			row->render[idx++] = '^';
-			row->render[idx++] = '@' + seq[y];
-		}
-		else if(28 <= seq[y] && seq[y] <= 31){
-			row->render[idx++] = '^';
-			row->render[idx++] = '?';
-		}
-		else{
-			row->render[idx++] = row->characters[y];
+	St.map.line_start = ( failed ? NULL : xmalloc(sizeof(size_t) * lines) );
+	long n = 0;
+	if(St.map.line_start){
+		St.map.line_start[n++] = 0;
+		for(long t = 0; t < nthreads; t++){
+			memcpy(St.map.line_start + n, jobs[t].starts, sizeof(size_t) * jobs[t].count);
+			n += jobs[t].count;
 		}
+		// a trailing newline ends the last line rather than starting a new one
+		if(St.map.line_start[n-1] == St.map.size) n--;
 	}
+	for(long t = 0; t < nthreads; t++) xfree(jobs[t].starts);
 
-	row->render[idx] = '\0';
-	row->rsize = idx;
-
-	row->hl = malloc(row->rsize);
-	editor_update_syntax(row);
+	St.map.lines = n;
+	return St.map.line_start ? 0 : -1;
 }
 
-void editor_insert_row(long at,char *s){
-
-	St.rows = realloc(St.rows ,sizeof(erow) * (St.num_rows + 1));
-
-	memmove(St.rows + at + 1, St.rows + at, sizeof(erow)*(St.num_rows - at));
-	for (long y = at + 1; y <= St.num_rows; y++) St.rows[y].idx++;
-
-
-	St.rows[at].idx = at;
-
-	St.rows[at].characters = s;
-	St.rows[at].size = strlen(s);
-
-	St.rows[at].rsize = 0;
-	St.rows[at].render = NULL;
-	St.rows[at].hl = NULL;
-	St.rows[at].hl_open_comment = 0;
-
-	editor_update_row(St.rows + at);
-
-	St.num_rows++;
-	St.modified++;
+int map_open(int fd, size_t size){
+	char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED) return -1;
+
+	St.map.data = data;
+	St.map.size = size;
+
+	madvise(data, size, MADV_SEQUENTIAL);
+	if(map_build_index() == -1){
+		munmap(data, size);
+		xfree(St.map.line_start);
+		St.map.data = NULL;
+		St.map.line_start = NULL;
+		St.map.size = 0;
+		St.map.lines = 0;
+		return -1;
+	}
+	madvise(data, size, MADV_NORMAL);
+	return 0;
 }
 
-void editor_row_insert_character(erow *row, long at, int ch){
-	row->characters = realloc(row->characters, row->size + 2);
-
-	long i = row->size;
-	while( i > at ){
-		row->characters[i] = row->characters[i-1];
-		i--;
+/* Swaps the mapping for an anonymous copy of it at the same address, so
+ * the rows, undo ops and line index that point into it stay good while
+ * the file under it is written over. Returns -1 with errno set if there
+ * isn't the memory for the copy. */
+int map_detach(){
+	if(St.map.data == NULL || St.map.detached) return 0;
+	char *copy = mmap(NULL, St.map.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(copy == MAP_FAILED) return -1;
+	memcpy(copy, St.map.data, St.map.size);
+	mprotect(copy, St.map.size, PROT_READ);
+	if(mremap(copy, St.map.size, St.map.size, MREMAP_MAYMOVE | MREMAP_FIXED, St.map.data) == MAP_FAILED){
+		int err = errno;
+		munmap(copy, St.map.size);
+		errno = err;
+		return -1;
 	}
-	row->characters[i] = ch;
-
-	row->size++;
-	row->characters[row->size] = '\0';
-
-	editor_update_row(row);
-	St.modified++;
+	St.map.detached = true;
+	return 0;
 }
 
-void editor_row_append_string(erow *row, const char *str, size_t len){
-	row->characters = realloc(row->characters, row->size + len + 1);
-	memcpy(row->characters + row->size, str, len);
-	row->size += len;
-	row->characters[row->size] = '\0';
-	editor_update_row(row);
-	St.modified++;
-}
+/* The lexer's comment state at the start of every MAP_STATE_LINES-th
+ * line of the file, kept while those lines are still read from the
+ * mapping so their state doesn't have to be scanned for from the top
+ * again. -1 where it isn't known. Only ever called for a line that is a
+ * multiple of MAP_STATE_LINES. */
 
-void editor_row_delete_character(erow *row, long at){
+#define MAP_STATE_LINES 64
 
-	long i = at + 1;
-	while(i < row->size + 1){
-		row->characters[i-1] = row->characters[i];
-		i++;
+signed char *map_comment_state(long line){
+	if(St.map.comment_state == NULL){
+		long n = St.map.lines / MAP_STATE_LINES + 1;
+		St.map.comment_state = xmalloc(n);
+		if(St.map.comment_state == NULL) die("malloc");
+		memset(St.map.comment_state, -1, n);
 	}
-	row->size--;
-
-	editor_update_row(row);
-	St.modified++;
+	return St.map.comment_state + line / MAP_STATE_LINES;
 }
 
-void editor_free_row(erow *row){
-	free(row->characters);
-	free(row->render);
-	free(row->hl);
+/* Forgets the states kept for lines [line, line + n). */
+void map_forget_comment_state(long line, long n){
+	if(St.map.comment_state == NULL) return;
+	long first = (line + MAP_STATE_LINES - 1) / MAP_STATE_LINES;
+	long last = (line + n + MAP_STATE_LINES - 1) / MAP_STATE_LINES;
+	if(last > first) memset(St.map.comment_state + first, -1, last - first);
 }
 
-void editor_delete_row(long at){
-	editor_free_row(St.rows + at);
-	memmove(St.rows + at, St.rows + at + 1, sizeof(erow)*(St.num_rows - at - 1));
-	for (int y = at; y < St.num_rows - 1; y++) St.rows[y].idx--;
+char *map_line(long line, long *len){
+	size_t start = St.map.line_start[line];
+	size_t end = ( line + 1 < St.map.lines ? St.map.line_start[line + 1] : St.map.size );
 
-	St.num_rows--;
-	St.modified++;
-}
+	while(end > start && (St.map.data[end-1] == '\n' || St.map.data[end-1] == '\r'))
+		end--;
 
-/* --- editor operations --- */
+	*len = end - start;
+	return St.map.data + start;
+}
 
-void editor_insert_newline_at_cursor(){
-	char *new_line;
-	if(cursor_below_last_line()){
-		new_line = malloc(1);
-		*new_line = '\0';
-		editor_insert_row(St.num_rows, new_line);
-	}
-	else{
-		erow *row = St.rows + St.cx;
-		char *new_line = strdup(row->characters + St.cy);
-		row->size = St.cy;
-		row->characters[row->size] = '\0';
-		editor_insert_row(St.cx + 1, new_line);
-		row = St.rows + St.cx; //editor_insert realloc()s rows so reassigning
-		editor_update_row(row); 
+/* --- row text --- */
+
+/* Text the editor owns for its rows comes out of big slabs instead of one
+ * malloc per row. Blocks are rounded up to a size class, each about half
+ * as big again as the one before, and freed blocks go on a free list of
+ * their class for the next row of about that size. The byte before a
+ * block holds its class, so only the pointer is needed to free or grow
+ * it. Blocks past the biggest class come from malloc, with their size
+ * stored in front of the class byte. */
+
+#define TEXT_SLAB_SIZE (256 * 1024)
+#define TEXT_CLASS_BIG 0xff
+
+const long text_class_size[TEXT_CLASSES] = { 16, 24, 32, 48, 64, 96, 128, 192, 256,
+	384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+
+/* Returns a block with room for `size` bytes. */
+char *text_alloc(long size){
+	STAT_ADD(arena_calls, 1);
+	int c = 0;
+	while(c < TEXT_CLASSES && text_class_size[c] < size + 1) c++;
+
+	if(c == TEXT_CLASSES){
+		char *p = xmalloc(sizeof(long) + 1 + size);
+		if(p == NULL) die("malloc");
+		memcpy(p, &size, sizeof(long));
+		p[sizeof(long)] = (char)TEXT_CLASS_BIG;
+		St.text.big += size;
+		return p + sizeof(long) + 1;
 	}
-	St.cy = 0;
-	St.cx++;
-}
 
-void editor_insert_char_at_cursor(int ch){
-	if(cursor_below_last_line()){
-		char *new_row = malloc(2);
-		sprintf(new_row, "%c", ch);
-		editor_insert_row(St.num_rows, new_row);
+	char *block = St.text.free[c];
+	if(block){
+		memcpy(&St.text.free[c], block + 1, sizeof(char *));
 	}
 	else{
-		editor_row_insert_character(St.rows + St.cx, St.cy, ch); 
+		if(St.text.slab == NULL || St.text.used + text_class_size[c] > TEXT_SLAB_SIZE){
+			St.text.slab = xmalloc(TEXT_SLAB_SIZE);
+			if(St.text.slab == NULL) die("malloc");
+			St.text.used = 0;
+			St.text.slabs++;
+		}
+		block = St.text.slab + St.text.used;
+		St.text.used += text_class_size[c];
 	}
-	St.cy++;
+	block[0] = c;
+	return block + 1;
 }
 
-void editor_delete_character_at_cursor(){
-	if(cursor_below_last_line()) return;
-
-	erow *row = St.rows + St.cx;
-	if(St.cx == St.num_rows - 1 && St.cy == row->size) return; //Cursor at bottom right
+long text_capacity(const char *p){
+	unsigned char c = p[-1];
+	if(c != TEXT_CLASS_BIG) return text_class_size[c] - 1;
+	long size;
+	memcpy(&size, p - 1 - sizeof(long), sizeof(long));
+	return size;
+}
 
-	if(St.cy == row->size){
-		editor_row_append_string(row, (row+1)->characters, (row+1)->size);
-		editor_delete_row(St.cx+1);
+void text_free(char *p){
+	if(p == NULL) return;
+	STAT_ADD(arena_calls, 1);
+	unsigned char c = p[-1];
+	if(c == TEXT_CLASS_BIG){
+		St.text.big -= text_capacity(p);
+		xfree(p - 1 - sizeof(long));
+		return;
 	}
-	else{
-		editor_row_delete_character(St.rows + St.cx, St.cy);
+	memcpy(p, &St.text.free[c], sizeof(char *));
+	St.text.free[c] = p - 1;
+}
+
+/* Like realloc(): the block keeps its place as long as its class has room. */
+char *text_realloc(char *p, long size){
+	if(p == NULL) return text_alloc(size);
+	long cap = text_capacity(p);
+	if(size <= cap) return p;
+
+	if((unsigned char)p[-1] == TEXT_CLASS_BIG){
+		char *block = xrealloc(p - 1 - sizeof(long), sizeof(long) + 1 + size);
+		if(block == NULL) die("realloc");
+		memcpy(block, &size, sizeof(long));
+		St.text.big += size - cap;
+		return block + sizeof(long) + 1;
 	}
+	char *q = text_alloc(size);
+	memcpy(q, p, cap);
+	text_free(p);
+	return q;
+}
 
+char *text_dup(const char *s, long len){
+	char *p = text_alloc(len + 1);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
 }
 
-/*  --- file io --- */ 
+/* --- row storage --- */
 
-void editor_open(const char *filename){
-	free(St.file_name);
-	St.file_name = strdup(filename);
+/* Rows are kept in a treap of pieces. A piece either holds up to
+ * ROW_PIECE_MAX consecutive erows, or (rows == NULL) stands for a run of
+ * untouched lines of the mapped file starting at file_line. Every node
+ * caches the number of rows in its subtree, so finding, inserting and
+ * deleting a row by line number is O(log n) instead of shifting the tail
+ * of one big array. Mapped runs are turned into erows a chunk at a time
+ * when a row in them is first needed. Row pointers stay valid until the
+ * next insert or delete. */
 
-	editor_select_syntax_highlight();
+#define ROW_PIECE_MAX 64
 
-	FILE *file = fopen(filename, "r");
-	if(file == NULL) die("editor_open");
+struct row_piece{
+	struct row_piece *left, *right;
+	unsigned priority;
+	long lines;     // rows held by this piece
+	long total;     // rows held by this piece and both subtrees
+	erow *rows;
+	long file_line;
+};
 
-	char *line = NULL;
-	size_t linecap = 0;
-	long linelen;
+struct row_iter{
+	struct row_piece *piece;
+	long offset;
+	long at;
+};
 
-	while((linelen = getline(&line, &linecap, file)) != -1){
-		while(linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-			linelen--;
-		line[linelen] = '\0';
-		editor_insert_row(St.num_rows, line);
-		line = NULL; linecap = 0;
-	}
-	fclose(file);
-	St.modified = 0;
+unsigned row_piece_priority(){
+	static unsigned seed = 2463534242u;
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
 }
 
-void editor_rows_to_string(char **full_string, long *total_length){
-	long total_len = 0;
-	for(long x = 0; x < St.num_rows; x++) total_len += strlen(St.rows[x].characters) + 1;
+long row_piece_total(struct row_piece *p){
+	return p ? p->total : 0;
+}
 
-	char *full_str = malloc(total_len + 1);
+void row_piece_fix(struct row_piece *p){
+	p->total = row_piece_total(p->left) + p->lines + row_piece_total(p->right);
+}
 
-	char *buf_ptr = full_str;
-	for(long x = 0; x < St.num_rows; x++){
-		long curr_row_len = St.rows[x].size;
-		memcpy(buf_ptr, St.rows[x].characters, curr_row_len);
-		buf_ptr += curr_row_len;
-		*buf_ptr = '\n';
-		buf_ptr++;
+struct row_piece *row_piece_new(bool mapped){
+	struct row_piece *p = xmalloc(sizeof(struct row_piece));
+	if(p == NULL) die("malloc");
+	p->rows = NULL;
+	if(!mapped){
+		p->rows = xmalloc(sizeof(erow) * ROW_PIECE_MAX);
+		if(p->rows == NULL) die("malloc");
 	}
-	full_str[total_len] = '\0';
-
-	*full_string = full_str;
-	*total_length = total_len;
+	p->left = p->right = NULL;
+	p->priority = row_piece_priority();
+	p->lines = p->total = 0;
+	p->file_line = 0;
+	return p;
 }
 
+void row_piece_free(struct row_piece *p){
+	xfree(p->rows);
+	xfree(p);
+}
 
-void editor_save_file(){
-	if(St.file_name == NULL) {
-		St.file_name = editor_prompt("Save as : %s  (Cancel = Esc)", NULL);
-		editor_select_syntax_highlight();
+struct row_piece *row_piece_merge(struct row_piece *a, struct row_piece *b){
+	if(a == NULL) return b;
+	if(b == NULL) return a;
+	if(a->priority > b->priority){
+		a->right = row_piece_merge(a->right, b);
+		row_piece_fix(a);
+		return a;
 	}
-	if(St.file_name == NULL) {
-		editor_set_status_message("Save aborted");
+	b->left = row_piece_merge(a, b->left);
+	row_piece_fix(b);
+	return b;
+}
+
+/* Splits t so that *l gets the first `at` rows and *r the rest, cutting a
+ * piece in two when `at` falls inside it. */
+void row_piece_split(struct row_piece *t, long at, struct row_piece **l, struct row_piece **r){
+	if(t == NULL){
+		*l = *r = NULL;
 		return;
 	}
 
-	char *buf; long len;
-	editor_rows_to_string(&buf, &len);
-	int fd = open(St.file_name, O_RDWR | O_CREAT, 0644);
-	if(fd != -1){
-		if(ftruncate(fd, len) != -1){
-			if(write(fd, buf, len) != -1){
-				close(fd);
-				free(buf);
-				editor_set_status_message("FILE SAVED. %d bytes written.", len);
-				St.modified = 0;
-				return;
-			}
-		}
-		close(fd);
+	long left_total = row_piece_total(t->left);
+	if(at <= left_total){
+		row_piece_split(t->left, at, l, &t->left);
+		row_piece_fix(t);
+		*r = t;
+	}
+	else if(at >= left_total + t->lines){
+		row_piece_split(t->right, at - left_total - t->lines, &t->right, r);
+		row_piece_fix(t);
+		*l = t;
+	}
+	else{
+		long k = at - left_total;
+		struct row_piece *tail = row_piece_new(t->rows == NULL);
+		tail->lines = t->lines - k;
+		if(t->rows)
+			memcpy(tail->rows, t->rows + k, sizeof(erow) * tail->lines);
+		else
+			tail->file_line = t->file_line + k;
+		row_piece_fix(tail);
+
+		t->lines = k;
+		*r = row_piece_merge(tail, t->right);
+		t->right = NULL;
+		row_piece_fix(t);
+		*l = t;
 	}
-	free(buf);
-	editor_set_status_message("SAVE FAILED. I/O error: %s", strerror(errno));
 }
 
-/* editor find */
-
-void editor_find_callback(char* query, int key){
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
-	if (saved_hl) {
-		memcpy(St.rows[saved_hl_line].hl, saved_hl, St.rows[saved_hl_line].rsize);
-		free(saved_hl);
-		saved_hl = NULL;
+/* Returns the piece holding row *at and turns *at into an offset inside it,
+ * adding `delta` to each subtree count passed on the way down. The position
+ * just past the last row resolves to the end of the last piece. */
+struct row_piece *row_piece_find(long *at, long delta){
+	struct row_piece *p = St.rows;
+	while(p){
+		p->total += delta;
+		long left_total = row_piece_total(p->left);
+		if(*at < left_total){
+			p = p->left;
+			continue;
+		}
+		*at -= left_total;
+		if(*at < p->lines || (*at == p->lines && p->right == NULL)) return p;
+		*at -= p->lines;
+		p = p->right;
 	}
+	return NULL;
+}
 
-	static int direction = 1;
-	static int last_match_line = -1;
-
-	if( key == '\r' || key == ESC ) return;
-	else if( key == ARROW_RIGHT || key == ARROW_DOWN ) direction = 1;
-	else if( key == ARROW_LEFT || key == ARROW_UP ) direction = -1;
-	else {
-		last_match_line = -1;
-		direction = 1;
+/* Turns the aligned chunk of mapped lines around row `at` into erows whose
+ * characters still point into the mapping. */
+void row_piece_materialize(long at){
+	long offset = at;
+	struct row_piece *p = row_piece_find(&offset, 0);
+
+	long line = p->file_line + offset;
+	long first = line - line % ROW_PIECE_MAX;
+	if(first < p->file_line) first = p->file_line;
+	long last = first + ROW_PIECE_MAX;
+	if(last > p->file_line + p->lines) last = p->file_line + p->lines;
+
+	long start = at - (line - first);
+	struct row_piece *l, *m, *r;
+	row_piece_split(St.rows, start, &l, &m);
+	row_piece_split(m, last - first, &m, &r);
+
+	m->rows = xmalloc(sizeof(erow) * ROW_PIECE_MAX);
+	if(m->rows == NULL) die("malloc");
+	for(long x = 0; x < m->lines; x++){
+		erow *row = m->rows + x;
+		row->characters = map_line(first + x, &row->size);
+		row->mapped = true;
+		editor_row_init_cache(row);
 	}
+	St.rows = row_piece_merge(row_piece_merge(l, m), r);
+}
 
-	int current = last_match_line;
-	char *match;
-	erow *row;
-	for(int i = 0; i < St.num_rows; i++){
-		current += direction;
-		if(current == -1) current = St.num_rows - 1;
-		else if(current == St.num_rows) current = 0;
+/* Returns row `at` only if it already exists as an erow. */
+erow *editor_row_peek(long at){
+	if(at < 0 || at >= St.num_rows) return NULL;
+	struct row_piece *p = row_piece_find(&at, 0);
+	return p->rows ? p->rows + at : NULL;
+}
 
-		row = St.rows + current;
-		match = strstr(row->characters, query);
-		if(match) break;
+erow *editor_row(long at){
+	if(at < 0 || at >= St.num_rows) return NULL;
+	long offset = at;
+	struct row_piece *p = row_piece_find(&offset, 0);
+	if(p->rows == NULL){
+		row_piece_materialize(at);
+		offset = at;
+		p = row_piece_find(&offset, 0);
 	}
+	return p->rows + offset;
+}
 
-	if(match){
-		St.cx = last_match_line = current;
-		St.cy = match - row->characters; 
-		St.row_offset = (current - St.screen_rows/2);
-		if(St.row_offset < 0) St.row_offset = 0;
-
-		editor_evaluate_ry();
-		saved_hl_line = current;
-		saved_hl = malloc(row->rsize);
-		memcpy(saved_hl, row->hl, row->rsize);
-		memset(row->hl + St.ry, HL_MATCH, strlen(query));
+void editor_rows_insert(long at, erow *row){
+	editor_gap_close();
+	long offset = at;
+	struct row_piece *p = row_piece_find(&offset, 0);
+
+	if(p && p->rows && p->lines < ROW_PIECE_MAX){
+		offset = at;
+		row_piece_find(&offset, 1);
+		memmove(p->rows + offset + 1, p->rows + offset, sizeof(erow) * (p->lines - offset));
+		p->rows[offset] = *row;
+		p->lines++;
+	}
+	else{
+		struct row_piece *l, *r, *n = row_piece_new(false);
+		n->rows[0] = *row;
+		n->lines = n->total = 1;
+		row_piece_split(St.rows, at, &l, &r);
+		St.rows = row_piece_merge(row_piece_merge(l, n), r);
 	}
+	St.num_rows++;
 }
 
-void editor_find(){
+void editor_rows_insert_many(long at, erow *rows, long n){
+	editor_gap_close();
+	struct row_piece *block = NULL;
+	for(long i = 0; i < n; i += ROW_PIECE_MAX){
+		struct row_piece *p = row_piece_new(false);
+		p->lines = p->total = ( n - i < ROW_PIECE_MAX ? n - i : ROW_PIECE_MAX );
+		memcpy(p->rows, rows + i, sizeof(erow) * p->lines);
+		block = row_piece_merge(block, p);
+	}
 
-	long cx_orig = St.cx;
-	long cy_orig = St.cy;
-	long row_offset_orig = St.row_offset;
-	long col_offset_orig = St.col_offset;
+	struct row_piece *l, *r;
+	row_piece_split(St.rows, at, &l, &r);
+	St.rows = row_piece_merge(row_piece_merge(l, block), r);
+	St.num_rows += n;
+}
 
-	char *query = editor_prompt("SEARCH : %s (Use Esc/Enter/ArrowKeys)", editor_find_callback);
+void editor_rows_remove(long at){
+	editor_gap_close();
+	long offset = at;
+	struct row_piece *p = row_piece_find(&offset, 0);
 
-	if(query){
-		free(query);
+	if(p->rows && p->lines > 1){
+		offset = at;
+		row_piece_find(&offset, -1);
+		memmove(p->rows + offset, p->rows + offset + 1, sizeof(erow) * (p->lines - offset - 1));
+		p->lines--;
 	}
 	else{
-		St.cx = cx_orig;
-		St.cy = cy_orig;
-		St.row_offset = row_offset_orig;
-		St.col_offset = col_offset_orig;
+		struct row_piece *l, *m, *r;
+		row_piece_split(St.rows, at, &l, &m);
+		row_piece_split(m, 1, &m, &r);
+		row_piece_free(m);
+		St.rows = row_piece_merge(l, r);
 	}
+	St.num_rows--;
 }
 
-/* --- appendable string --- */ 
+/* Takes rows [at, at + n) out of the tree and returns them as a tree of
+ * their own, which editor_rows_splice() can put back. */
+struct row_piece *editor_rows_cut(long at, long n){
+	editor_gap_close();
+	struct row_piece *l, *m, *r;
+	row_piece_split(St.rows, at, &l, &m);
+	row_piece_split(m, n, &m, &r);
+	St.rows = row_piece_merge(l, r);
+	St.num_rows -= n;
+	return m;
+}
 
-struct appendable_str{
-	char *buf;
-	long len;
-};
-#define INIT_APPENDABLE_STR { NULL, 0 };
+void editor_rows_splice(long at, struct row_piece *rows){
+	editor_gap_close();
+	St.num_rows += row_piece_total(rows);
+	struct row_piece *l, *r;
+	row_piece_split(St.rows, at, &l, &r);
+	St.rows = row_piece_merge(row_piece_merge(l, rows), r);
+}
 
-void append(struct appendable_str *to, const char *str, long len){
-	if(len <= 0) return;
-	to->buf = realloc(to->buf, to->len + len);
+/* Row iterators walk the rows one piece at a time, only going back to the
+ * tree when stepping over a piece boundary. row_iter_text() reads a line
+ * without materializing it; row_iter_row() materializes it if needed. */
+
+bool row_iter_seek(struct row_iter *it, long at){
+	it->at = at;
+	it->piece = NULL;
+	if(at < 0 || at >= St.num_rows) return false;
+	it->offset = at;
+	it->piece = row_piece_find(&it->offset, 0);
+	return true;
+}
 
-	if(to->buf == NULL) return;
-	memcpy(to->buf + to->len, str, len);
-	to->len += len;
+bool row_iter_step(struct row_iter *it, int direction){
+	long offset = it->offset + direction;
+	if(it->piece == NULL || offset < 0 || offset >= it->piece->lines)
+		return row_iter_seek(it, it->at + direction);
+	it->at += direction;
+	it->offset = offset;
+	return true;
 }
 
-void free_appendable_str(struct appendable_str *str){
-	free(str->buf);
+char *row_iter_text(struct row_iter *it, long *len){
+	if(it->piece->rows == NULL) return map_line(it->piece->file_line + it->offset, len);
+	erow *row = it->piece->rows + it->offset;
+	if(row == St.gap.row) editor_gap_close();
+	*len = row->size;
+	return row->characters;
 }
 
-int get_cursor_position(long *X, long *Y){
-	if( write(STDOUT_FILENO, "\x1b[6n", 4) != 4 ) return -1;
+erow *row_iter_row(struct row_iter *it){
+	if(it->piece->rows == NULL){
+		row_piece_materialize(it->at);
+		row_iter_seek(it, it->at);
+	}
+	return it->piece->rows + it->offset;
+}
 
-	char buf[32];
-	char ch;
+/* --- ROW OPERATIONS --- */
 
-	unsigned i = 0;
-	while (read(STDIN_FILENO, &ch, 1) == 1 && ch != 'R') {
-		buf[i] = ch;
-		i++;
-	}
+bool cursor_below_last_line(){
+	return St.cx == St.num_rows;
+}
 
-	buf[i] = '\0';
+/* render and hl are a cache, rebuilt only for rows that are drawn or
+ * searched to. A row's cache is valid while its gen matches St.rc.render_gen;
+ * editing a row clears its gen and choosing a new syntax bumps
+ * St.rc.render_gen, so neither costs more than the rows later looked at. */
+
+void editor_row_init_cache(erow *row){
+	row->rsize = 0;
+	row->render = NULL;
+	row->render_alias = false;
+	row->hl = NULL;
+	row->index = NULL;
+	row->hl_open_comment = 0;
+	row->hl_start_state = 0;
+	row->gen = 0;
+}
 
-	if(buf[0] != '\x1b' || buf[1] != '[') return -1;
-	if(sscanf(buf + 2, "%ld;%ld", X, Y) != 2) return -1;
+void editor_row_free_index(erow *row){
+	if(row->index == NULL) return;
+	xfree(row->index->ckpt);
+	xfree(row->index);
+	row->index = NULL;
+}
 
-	return 0;
+/* hl holds two cells a byte, the even one in the low nibble, so it takes
+ * hl_bytes(rsize) bytes. */
+
+long hl_bytes(long cells){
+	return cells / 2 + 1;
 }
 
-int get_window_size(long *X, long *Y){
-	struct winsize ws;
+unsigned char hl_get(const unsigned char *hl, long i){
+	if(hl == NULL) return HL_NORMAL;
+	return (hl[i >> 1] >> ((i & 1) * 4)) & 0x0f;
+}
+
+void hl_set(unsigned char *hl, long i, int v){
+	unsigned char *b = hl + (i >> 1);
+	if(i & 1) *b = (*b & 0x0f) | (v << 4);
+	else *b = (*b & 0xf0) | v;
+}
+
+void hl_fill(unsigned char *hl, long from, int v, long n){
+	long to = from + n;
+	if(n <= 0) return;
+	if(from & 1) hl_set(hl, from++, v);
+	if((to & 1) && to > from) hl_set(hl, --to, v);
+	if(to > from) memset(hl + from / 2, v | v << 4, (to - from) / 2);
+}
+
+/* Sets hl[b, b + n) to the high half of each byte from hl + k on, joined
+ * with the low half of the byte after it. The ranges may overlap: the copy
+ * runs downwards when k < b and upwards otherwise. */
+void hl_join_halves(unsigned char *hl, long b, long k, long n){
+	long i = 0;
+	if(k < b){
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		for(; n >= 8; n -= 8){
+			uint64_t w;
+			memcpy(&w, hl + k + n - 8, 8);
+			w = (w >> 4) | ((uint64_t)hl[k + n] << 60);
+			memcpy(hl + b + n - 8, &w, 8);
+		}
+#endif
+		while(--n >= 0)
+			hl[b + n] = (hl[k + n] >> 4) | (unsigned char)(hl[k + n + 1] << 4);
+	}
+	else{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		for(; i + 8 <= n; i += 8){
+			uint64_t w;
+			memcpy(&w, hl + k + i, 8);
+			w = (w >> 4) | ((uint64_t)hl[k + i + 8] << 60);
+			memcpy(hl + b + i, &w, 8);
+		}
+#endif
+		for(; i < n; i++)
+			hl[b + i] = (hl[k + i] >> 4) | (unsigned char)(hl[k + i + 1] << 4);
+	}
+}
+
+/* memmove() for cells. When dst and src are an odd number of cells apart
+ * every byte is put together from the halves of two source bytes. */
+void hl_move(unsigned char *hl, long dst, long src, long n){
+	if(n <= 0 || dst == src) return;
+	long d = dst - src, first = dst, last = dst + n;
+	long b0 = (first + 1) / 2, b1 = last / 2;    // bytes whose cells both move
+	bool lead = first & 1, trail = last & 1;
+
+	if(d > 0 && trail) hl_set(hl, last - 1, hl_get(hl, last - 1 - d));
+	if(d < 0 && lead) hl_set(hl, first, hl_get(hl, first - d));
+	if(d % 2 == 0){
+		memmove(hl + b0, hl + b0 - d / 2, b1 - b0);
+	}
+	else{
+		hl_join_halves(hl, b0, (2 * b0 - d) / 2, b1 - b0);
+	}
+	if(d > 0 && lead) hl_set(hl, first, hl_get(hl, first - d));
+	if(d < 0 && trail) hl_set(hl, last - 1, hl_get(hl, last - 1 - d));
+}
+
+bool hl_is_plain(const unsigned char *hl, long cells){
+	for(long b = 0; b < hl_bytes(cells); b++)
+		if(hl[b]) return false;
+	return true;
+}
+
+void editor_update_row(long at){
+	erow *row = editor_row(at);
+	row->gen = 0;
+	if(row->index) row->index->dirty_from = -1;
+}
+
+/* Marks row `at` stale after `removed` characters at `from` were replaced
+ * by `inserted` new ones. As long as the row's render is from the current
+ * syntax, the edits are folded into one dirty span, so the next render
+ * only redoes the part of the row around them. */
+void editor_update_row_span(long at, long from, long removed, long inserted){
+	erow *row = editor_row(at);
+	struct row_index *ix = row->index;
+	if(ix == NULL){
+		row->gen = 0;
+		return;
+	}
+	if(row->gen == St.rc.render_gen){
+		ix->dirty_from = from;
+		ix->dirty_end = from;
+		ix->dirty_shift = 0;
+		ix->dirty_gen = St.rc.render_gen;
+	}
+	else if(ix->dirty_from < 0 || ix->dirty_gen != St.rc.render_gen){
+		ix->dirty_from = -1;
+		return;
+	}
+
+	if(from < ix->dirty_from) ix->dirty_from = from;
+	if(from < ix->dirty_end)
+		ix->dirty_end = ( ix->dirty_end - removed > from ? ix->dirty_end - removed : from );
+	else
+		ix->dirty_end = from;
+	ix->dirty_end += inserted;
+	ix->dirty_shift += inserted - removed;
+	row->gen = 0;
+}
+
+long editor_render_width(char ch, long r){
+	if(ch == '\t') return SEDIT_TAB_STOP - r % SEDIT_TAB_STOP;
+	if((0 <= ch && ch <= 26) || (28 <= ch && ch <= 31)) return 2;
+	return 1;
+}
+
+void editor_render_char(struct appendable_str *to, char ch, long r){
+	if(ch == '\t'){
+		append(to, "        ", editor_render_width(ch, r));
+	}
+	else if(0 <= ch && ch <= 26){
+		char s[2] = { '^', '@' + ch };
+		append(to, s, 2);
+	}
+	else if(28 <= ch && ch <= 31){
+		append(to, "^?", 2);
+	}
+	else{
+		append(to, &ch, 1);
+	}
+}
+
+/* Returns the last checkpoint at or before character c. */
+long editor_row_checkpoint_before(erow *row, long c){
+	struct row_index *ix = row->index;
+	long lo = 0, hi = ix->nckpt - 1;
+	while(lo < hi){
+		long mid = (lo + hi + 1) / 2;
+		if(ix->ckpt[mid].c <= c) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+/* Returns the render column of character `at` of a rendered row. */
+long editor_row_cx_to_rx(erow *row, long at){
+	if(row->render_alias) return at;
+	long c = 0, r = 0;
+	if(row->index && row->index->nckpt > 0){
+		long k = editor_row_checkpoint_before(row, at);
+		c = row->index->ckpt[k].c;
+		r = row->index->ckpt[k].r;
+	}
+
+	const char *runs[2] = { NULL, NULL };
+	long lens[2] = { 0, 0 };
+	editor_row_runs(row, runs, lens);
+	for(; c < at; c++)
+		r += editor_render_width(( c < lens[0] ? runs[0][c] : runs[1][c - lens[0]] ), r);
+	return r;
+}
+
+/* Re-renders a row after edits to the characters in [dirty_from,
+ * dirty_end). Rendering starts at the last checkpoint before them and
+ * stops at the first old checkpoint past them where the render is back on
+ * the same tab stop. The old render and hl from there on are moved into
+ * place. The lexer is told to resume at the last checkpoint it stopped at
+ * that is far enough back that no token seen before it reaches the edit.
+ * Returns false when the row has to be rendered from scratch. */
+bool row_render_partial(struct row_context *ctx, erow *row, const char **runs, long *lens){
+	struct row_index *ix = row->index;
+	if(ix == NULL || row->render_alias || ix->dirty_from < 0 || ix->dirty_gen != ctx->render_gen ||
+			ix->nckpt == 0)
+		return false;
+
+	long k0 = editor_row_checkpoint_before(row, ix->dirty_from);
+	long lex_k = editor_row_checkpoint_before(row, ix->dirty_from - row_lex_lookahead(ctx));
+	while(lex_k > 0 && !ix->ckpt[lex_k].lexed) lex_k--;
+
+	long c0 = ix->ckpt[k0].c, r0 = ix->ckpt[k0].r;
+	long c = c0, r = r0;
+	long j = k0 + 1, converge = -1;
+	struct appendable_str *tmp = &ctx->render_tmp;
+	tmp->len = 0;
+
+	struct row_checkpoint *fresh = NULL;
+	long nfresh = 0, fresh_cap = 0;
+	long last_tab = -1;
+
+	while(c < row->size){
+		if(c >= ix->dirty_end){
+			while(j < ix->nckpt && ix->ckpt[j].c + ix->dirty_shift < c) j++;
+			if(j < ix->nckpt && ix->ckpt[j].c + ix->dirty_shift == c &&
+					((r - ix->ckpt[j].r) % SEDIT_TAB_STOP == 0 || ix->last_tab < ix->ckpt[j].c)){
+				converge = j;
+				break;
+			}
+		}
+		if(c > c0 && (c - c0) % ROW_CHECKPOINT_STRIDE == 0){
+			if(nfresh == fresh_cap){
+				fresh_cap = fresh_cap ? fresh_cap * 2 : 16;
+				fresh = xrealloc(fresh, sizeof(struct row_checkpoint) * fresh_cap);
+				if(fresh == NULL) die("realloc");
+			}
+			fresh[nfresh].c = c;
+			fresh[nfresh].r = r;
+			fresh[nfresh].lexed = false;
+			nfresh++;
+		}
+		char ch = ( c < lens[0] ? runs[0][c] : runs[1][c - lens[0]] );
+		if(ch == '\t') last_tab = c;
+		editor_render_char(tmp, ch, r);
+		r = r0 + tmp->len;
+		c++;
+	}
+
+	if(converge >= 0 && ix->last_tab >= ix->ckpt[converge].c)
+		ix->last_tab += ix->dirty_shift;
+	else if(last_tab == -1 && ix->last_tab >= c0)
+		ix->last_tab = c0 - 1;
+	else if(last_tab > ix->last_tab || ix->last_tab >= c0)
+		ix->last_tab = last_tab;
+
+	long old_tail = ( converge >= 0 ? ix->ckpt[converge].r : row->rsize );
+	long tail_len = row->rsize - old_tail;
+	long rdelta = r - old_tail;
+	long rsize = r + tail_len;
+
+	if(rdelta > 0){
+		row->render = xrealloc(row->render, rsize + 1);
+		if(row->render == NULL) die("realloc");
+		if(row->hl){
+			row->hl = xrealloc(row->hl, hl_bytes(rsize));
+			if(row->hl == NULL) die("realloc");
+		}
+	}
+	memmove(row->render + r, row->render + old_tail, tail_len + 1);
+	if(row->hl) hl_move(row->hl, r, old_tail, tail_len);
+	memcpy(row->render + r0, tmp->buf, tmp->len);
+	row->rsize = rsize;
+
+	long kept = ( converge >= 0 ? ix->nckpt - converge : 0 );
+	long n = k0 + 1 + nfresh + kept;
+	if(n > ix->nckpt){
+		ix->ckpt = xrealloc(ix->ckpt, sizeof(struct row_checkpoint) * n);
+		if(ix->ckpt == NULL) die("realloc");
+	}
+	if(kept) memmove(ix->ckpt + k0 + 1 + nfresh, ix->ckpt + converge, sizeof(struct row_checkpoint) * kept);
+	for(long k = k0 + 1 + nfresh; k < n; k++){
+		ix->ckpt[k].c += ix->dirty_shift;
+		ix->ckpt[k].r += rdelta;
+	}
+	if(nfresh) memcpy(ix->ckpt + k0 + 1, fresh, sizeof(struct row_checkpoint) * nfresh);
+	ix->nckpt = n;
+	xfree(fresh);
+
+	ctx->lex_resume.row = row;
+	ctx->lex_resume.k = lex_k;
+	ctx->lex_resume.converge = k0 + 1 + nfresh;
+	return true;
+}
+
+/* Rebuilds the render of row under ctx, only around the edits made since
+ * the last one when it can, and leaves its hl to row_highlight(). */
+void row_render(struct row_context *ctx, erow *row){
+	long tabs = 0, ctrls = 0, misellanous = 0;
+	const char *runs[2] = { NULL, NULL };
+	long lens[2] = { 0, 0 };
+	int nruns = editor_row_runs(row, runs, lens);
+
+	if(row_render_partial(ctx, row, runs, lens)){
+		row->gen = ctx->render_gen;
+		row->index->dirty_from = -1;
+		return;
+	}
+	ctx->lex_resume.row = NULL;
+
+	for(int k = 0; k < nruns; k++){
+		const char *seq = runs[k];
+		for(long y = 0; y < lens[k]; y++){
+			tabs += seq[y] == '\t';
+			ctrls += (0 <= seq[y] && seq[y] <= 26);
+			misellanous += (28 <= seq[y] && seq[y] <= 31);
+		}
+	}
+
+	// A row with nothing to expand is its own render. The lexer may look
+	// one byte past the end, so a mapped row needs one more byte of the map.
+	if(tabs + ctrls + misellanous == 0 && nruns == 1 &&
+			( !row->mapped || row->characters + row->size < St.map.data + St.map.size )){
+		if(!row->render_alias) xfree(row->render);
+		row->render = row->characters;
+		row->render_alias = true;
+		row->rsize = row->size;
+		editor_row_free_index(row);
+		row->gen = ctx->render_gen;
+		return;
+	}
+
+	if(row->render_alias) row->render = NULL;
+	row->render_alias = false;
+	row->render = xrealloc(row->render, row->size + tabs*(SEDIT_TAB_STOP - 1) + ctrls + misellanous + 1);
+	if(row->render == NULL) die("realloc");
+
+	struct row_index *ix = NULL;
+	if(row->size >= ROW_CHECKPOINT_STRIDE){
+		if(row->index == NULL){
+			row->index = xmalloc(sizeof(struct row_index));
+			if(row->index == NULL) die("malloc");
+			row->index->ckpt = NULL;
+		}
+		ix = row->index;
+		ix->ckpt = xrealloc(ix->ckpt, sizeof(struct row_checkpoint) * (row->size / ROW_CHECKPOINT_STRIDE + 1));
+		if(ix->ckpt == NULL) die("realloc");
+	}
+	else{
+		editor_row_free_index(row);
+	}
+
+	long idx = 0, c = 0, nckpt = 0, last_tab = -1;
+	for(int k = 0; k < nruns; k++){
+		const char *seq = runs[k];
+		for(long y = 0; y < lens[k]; y++, c++){
+			if(ix && c % ROW_CHECKPOINT_STRIDE == 0){
+				ix->ckpt[nckpt].c = c;
+				ix->ckpt[nckpt].r = idx;
+				ix->ckpt[nckpt].lexed = false;
+				nckpt++;
+			}
+			if(seq[y] == '\t'){
+				last_tab = c;
+				do{
+					row->render[idx++] = ' ';
+				} while(idx % SEDIT_TAB_STOP);
+			}
+			else if(0 <= seq[y] && seq[y] <= 26){
+				row->render[idx++] = '^';
+				row->render[idx++] = '@' + seq[y];
+			}
+			else if(28 <= seq[y] && seq[y] <= 31){
+				row->render[idx++] = '^';
+				row->render[idx++] = '?';
+			}
+			else{
+				row->render[idx++] = seq[y];
+			}
+		}
+	}
+
+	row->render[idx] = '\0';
+	row->rsize = idx;
+	if(ix){
+		ix->nckpt = nckpt;
+		ix->last_tab = last_tab;
+		ix->dirty_from = -1;
+	}
+
+	row->gen = ctx->render_gen;
+}
+
+/* Returns the render column of a cursor on character `at` of row,
+ * rendering the row under ctx first if it isn't current there. */
+long row_cursor_rx(struct row_context *ctx, erow *row, long at){
+	if(row->gen != ctx->render_gen) row_render(ctx, row);
+	return editor_row_cx_to_rx(row, at);
+}
+
+void editor_render_row(long at){
+	row_render(&St.rc, editor_row(at));
+	editor_update_syntax(at);
+}
+
+/* Returns row `at` with an up to date render and hl. Stale rows right
+ * above it are rebuilt first so the comment state flowing into it is
+ * current. */
+erow *editor_row_rendered(long at){
+	if(at >= St.hl_dirty_from) editor_syntax_catch_up(at);
+
+	erow *row = editor_row(at);
+	if(row->gen == St.rc.render_gen) return row;
+
+	long first = at;
+	erow *prev;
+	while((prev = editor_row_peek(first - 1)) && prev->gen != St.rc.render_gen)
+		first--;
+	for(long x = first; x <= at; x++)
+		editor_render_row(x);
+	return row;
+}
+
+/* Brings the rows on screen and a margin around them up to date, so the
+ * next few scroll steps find them ready. */
+void editor_prefetch_rows(){
+	long first = St.row_offset - SEDIT_RENDER_PREFETCH;
+	long last = St.row_offset + St.screen_rows + SEDIT_RENDER_PREFETCH;
+	if(first < 0) first = 0;
+	if(last > St.num_rows) last = St.num_rows;
+	for(long x = first; x < last; x++)
+		editor_row_rendered(x);
+}
+
+/* Inserts a row of size characters at s. Unless the row is mapped, s
+ * must come from text_alloc() and the row takes ownership of it. */
+void editor_insert_row_text(long at, char *s, long size, bool mapped){
+	erow row;
+
+	row.characters = s;
+	row.size = size;
+	row.mapped = mapped;
+	editor_row_init_cache(&row);
+	journal_row('r', at, s, row.size);
+	undo_rows_in(at, 1);
+
+	editor_syntax_dirty(at, 1);
+	editor_rows_insert(at, &row);
+	editor_update_row(at);
+
+	St.modified++;
+}
+
+/* Takes ownership of s, which must come from text_alloc(). */
+void editor_insert_row(long at,char *s){
+	editor_insert_row_text(at, s, strlen(s), false);
+}
+
+/* Inserts n rows at `at`, taking ownership of lines[i], a text_alloc()
+ * block holding sizes[i] characters and a terminating nul. The rows are packed into
+ * fresh pieces and spliced in with one split and merge of the tree. */
+void editor_insert_rows(long at, char **lines, long *sizes, long n){
+	if(n <= 0) return;
+	erow *rows = xmalloc(sizeof(erow) * n);
+	if(rows == NULL) die("malloc");
+
+	for(long i = 0; i < n; i++){
+		rows[i].characters = lines[i];
+		rows[i].size = sizes[i];
+		rows[i].mapped = false;
+		editor_row_init_cache(rows + i);
+		journal_row('r', at + i, lines[i], sizes[i]);
+	}
+	undo_rows_in(at, n);
+
+	editor_syntax_dirty(at, n);
+	editor_rows_insert_many(at, rows, n);
+	xfree(rows);
+
+	// the row after them has new rows above it
+	erow *next = editor_row_peek(at + n);
+	if(next) editor_update_row(at + n);
+	St.modified++;
+}
+
+/* Gives the row its own copy of characters before it is edited. */
+void editor_row_own(erow *row){
+	if(!row->mapped) return;
+	row->characters = text_dup(row->characters, row->size);
+	row->mapped = false;
+}
+
+/* The row being typed into keeps a gap at the cursor, so inserting or
+ * deleting a character there costs the same however long the row is.
+ * Its characters are characters[0, gap.at) followed by
+ * characters[gap.at + gap.len, size + gap.len). The gap is closed before
+ * anything reads the row as one string and before the row tree changes
+ * shape, since that moves the erow. */
+
+void editor_gap_close(){
+	erow *row = St.gap.row;
+	if(row == NULL) return;
+	memmove(row->characters + St.gap.at, row->characters + St.gap.at + St.gap.len, row->size - St.gap.at);
+	row->characters[row->size] = '\0';
+	St.gap.row = NULL;
+}
+
+/* Moves the gap of row x to `at`, opening it there if the row has none,
+ * and makes it at least `need` characters long. */
+erow *editor_gap_move(long x, long at, long need){
+	erow *row = editor_row(x);
+	if(St.gap.row != row){
+		editor_gap_close();
+		editor_row_own(row);
+		St.gap.row = row;
+		St.gap.at = row->size;
+		St.gap.len = 0;
+	}
+
+	if(St.gap.len < need){
+		long len = row->size > need ? row->size : need;
+		if(len < 16) len = 16;
+		row->characters = text_realloc(row->characters, row->size + len + 1);
+		memmove(row->characters + St.gap.at + len, row->characters + St.gap.at + St.gap.len,
+				row->size - St.gap.at);
+		St.gap.len = len;
+	}
+
+	if(at < St.gap.at)
+		memmove(row->characters + at + St.gap.len, row->characters + at, St.gap.at - at);
+	else if(at > St.gap.at)
+		memmove(row->characters + St.gap.at, row->characters + St.gap.at + St.gap.len, at - St.gap.at);
+	St.gap.at = at;
+	return row;
+}
+
+/* Returns the characters of a row as one run, or two around the gap of
+ * the row being edited. */
+int editor_row_runs(erow *row, const char **runs, long *lens){
+	runs[0] = row->characters;
+	if(row != St.gap.row){
+		lens[0] = row->size;
+		return 1;
+	}
+	lens[0] = St.gap.at;
+	runs[1] = row->characters + St.gap.at + St.gap.len;
+	lens[1] = row->size - St.gap.at;
+	return 2;
+}
+
+void editor_row_insert_text(long x, long at, const char *s, long len){
+	if(len == 0) return;
+	journal_insert(x, at, s, len);
+	undo_insert(x, at, len);
+	erow *row = editor_gap_move(x, at, len);
+	memcpy(row->characters + St.gap.at, s, len);
+	St.gap.at += len;
+	St.gap.len -= len;
+	row->size += len;
+
+	editor_update_row_span(x, at, 0, len);
+	St.modified++;
+}
+
+void editor_row_insert_character(long x, long at, int ch){
+	char c = ch;
+	editor_row_insert_text(x, at, &c, 1);
+}
+
+void editor_row_append_string(long x, const char *str, size_t len){
+	editor_gap_close();
+	erow *row = editor_row(x);
+	journal_insert(x, row->size, str, len);
+	undo_insert(x, row->size, len);
+	editor_row_own(row);
+	row->characters = text_realloc(row->characters, row->size + len + 1);
+	memcpy(row->characters + row->size, str, len);
+	editor_update_row_span(x, row->size, 0, len);
+	row->size += len;
+	row->characters[row->size] = '\0';
+	St.modified++;
+}
+
+void editor_row_delete_text(long x, long at, long len){
+	if(len == 0) return;
+	journal_delete(x, at, len);
+	undo_delete(x, at, len);
+	erow *row = editor_gap_move(x, at, 0);
+	St.gap.len += len;
+	row->size -= len;
+
+	editor_update_row_span(x, at, len, 0);
+	St.modified++;
+}
+
+void editor_row_delete_character(long x, long at){
+	editor_row_delete_text(x, at, 1);
+}
+
+/* Makes text, a text_alloc() block of size characters and a nul, the
+ * text of row x. */
+void editor_row_set_text(long x, char *text, long size){
+	journal_row('s', x, text, size);
+	editor_gap_close();
+	erow *row = editor_row(x);
+	if(!undo_set(x, row) && !row->mapped) text_free(row->characters);
+	row->characters = text;
+	row->size = size;
+	row->mapped = false;
+	editor_update_row(x);
+	editor_syntax_dirty(x, 0);
+	St.modified++;
+}
+
+void editor_free_row(erow *row){
+	if(row == St.gap.row) St.gap.row = NULL;
+	if(!row->mapped) text_free(row->characters);
+	if(!row->render_alias) xfree(row->render);
+	xfree(row->hl);
+	editor_row_free_index(row);
+}
+
+void editor_delete_row(long at){
+	journal_row('x', at, NULL, 0);
+	erow *row = editor_row(at);
+	undo_row_out(at, row);
+	editor_free_row(row);
+	editor_rows_remove(at);
+	editor_syntax_dirty(at, -1);
+
+	// the row moving up has a new row above it, so its start state is suspect
+	erow *next = editor_row_peek(at);
+	if(next) editor_update_row(at);
+	St.modified++;
+}
+
+/* Drops the render caches of the rows in p and returns the bytes the rows
+ * still hold. */
+long row_piece_forget(struct row_piece *p){
+	if(p == NULL) return 0;
+	long bytes = sizeof(struct row_piece) + row_piece_forget(p->left) + row_piece_forget(p->right);
+	if(p->rows == NULL){
+		map_forget_comment_state(p->file_line, p->lines);
+		return bytes;
+	}
+	bytes += sizeof(erow) * ROW_PIECE_MAX;
+	for(long x = 0; x < p->lines; x++){
+		erow *row = p->rows + x;
+		if(!row->render_alias) xfree(row->render);
+		xfree(row->hl);
+		editor_row_free_index(row);
+		editor_row_init_cache(row);
+		if(!row->mapped) bytes += text_capacity(row->characters) + 1;
+	}
+	return bytes;
+}
+
+void row_piece_free_all(struct row_piece *p){
+	if(p == NULL) return;
+	row_piece_free_all(p->left);
+	row_piece_free_all(p->right);
+	for(long x = 0; p->rows && x < p->lines; x++)
+		if(!p->rows[x].mapped) text_free(p->rows[x].characters);
+	row_piece_free(p);
+}
+
+void journal_rows(struct row_piece *p, long *line){
+	if(p == NULL) return;
+	journal_rows(p->left, line);
+	for(long x = 0; x < p->lines; x++, (*line)++){
+		long len;
+		const char *s = ( p->rows ? p->rows[x].characters : map_line(p->file_line + x, &len) );
+		journal_row('r', *line, s, ( p->rows ? p->rows[x].size : len ));
+	}
+	journal_rows(p->right, line);
+}
+
+/* Takes rows [at, at + n) out of the buffer in one piece, their text kept
+ * and their caches dropped, and sets *bytes to what they hold. */
+struct row_piece *editor_cut_rows(long at, long n, long *bytes){
+	journal_row('X', at, NULL, n);
+	struct row_piece *rows = editor_rows_cut(at, n);
+	*bytes = row_piece_forget(rows);
+	editor_syntax_dirty(at, -n);
+
+	erow *next = editor_row_peek(at);
+	if(next) editor_update_row(at);
+	St.modified++;
+	return rows;
+}
+
+/* Puts back rows taken out by editor_cut_rows(). */
+void editor_splice_rows(long at, struct row_piece *rows){
+	long line = at, n = row_piece_total(rows);
+	journal_rows(rows, &line);
+	editor_syntax_dirty(at, n);
+	editor_rows_splice(at, rows);
+
+	// the row after them has new rows above it
+	erow *next = editor_row_peek(at + n);
+	if(next) editor_update_row(at + n);
+	St.modified++;
+}
+
+/* --- editor operations --- */
+
+void editor_insert_newline_at_cursor(){
+	char *new_line;
+	if(cursor_below_last_line()){
+		new_line = text_dup("", 0);
+		editor_insert_row(St.num_rows, new_line);
+	}
+	else{
+		editor_gap_close();
+		erow *row = editor_row(St.cx);
+		editor_row_own(row);
+		char *new_line = text_dup(row->characters + St.cy, row->size - St.cy);
+		journal_delete(St.cx, St.cy, row->size - St.cy);
+		undo_delete(St.cx, St.cy, row->size - St.cy);
+		editor_update_row_span(St.cx, St.cy, row->size - St.cy, 0);
+		row->size = St.cy;
+		row->characters[row->size] = '\0';
+		editor_insert_row(St.cx + 1, new_line); //invalidates row
+	}
+	St.cy = 0;
+	St.cx++;
+}
+
+void editor_insert_char_at_cursor(int ch){
+	if(cursor_below_last_line()){
+		char c = ch;
+		char *new_row = text_dup(&c, 1);
+		editor_insert_row(St.num_rows, new_row);
+	}
+	else{
+		editor_row_insert_character(St.cx, St.cy, ch); 
+	}
+	St.cy++;
+}
+
+long line_break_length(const char *text, long len, long i){
+	if(text[i] == '\r') return ( i + 1 < len && text[i+1] == '\n' ) ? 2 : 1;
+	return text[i] == '\n';
+}
+
+/* Inserts a block of text at the cursor as if it had been typed, with
+ * "\r\n", "\r" and "\n" each starting a new line. The lines after the
+ * first are added with one bulk insert, and rendering is left to the
+ * next frame like any other edit. */
+void editor_insert_text_at_cursor(const char *text, long len){
+	long i = 0, brk;
+	while(cursor_below_last_line() && i < len && (brk = line_break_length(text, len, i))){
+		editor_insert_newline_at_cursor();
+		i += brk;
+	}
+	if(i == len) return;
+
+	if(cursor_below_last_line()){
+		editor_insert_row(St.num_rows, text_dup("", 0));
+	}
+
+	long n = 0, cap = 16;
+	char **lines = xmalloc(sizeof(char *) * cap);
+	long *sizes = xmalloc(sizeof(long) * cap);
+	const char *first = text + i;
+	long first_size = -1;
+	while(1){
+		long start = i;
+		while(i < len && text[i] != '\r' && text[i] != '\n') i++;
+
+		if(first_size == -1){
+			first_size = i - start;
+		}
+		else{
+			if(n == cap){
+				cap *= 2;
+				lines = xrealloc(lines, sizeof(char *) * cap);
+				sizes = xrealloc(sizes, sizeof(long) * cap);
+				if(lines == NULL || sizes == NULL) die("realloc");
+			}
+			lines[n] = text_dup(text + start, i - start);
+			sizes[n++] = i - start;
+		}
+
+		if(i == len) break;
+		i += line_break_length(text, len, i);
+	}
+
+	editor_gap_close();
+	erow *row = editor_row(St.cx);
+	editor_row_own(row);
+	long tail_size = row->size - St.cy;
+
+	if(n == 0){
+		journal_insert(St.cx, St.cy, first, first_size);
+		undo_insert(St.cx, St.cy, first_size);
+		row->characters = text_realloc(row->characters, row->size + first_size + 1);
+		memmove(row->characters + St.cy + first_size, row->characters + St.cy, tail_size + 1);
+		memcpy(row->characters + St.cy, first, first_size);
+		row->size += first_size;
+		editor_update_row_span(St.cx, St.cy, 0, first_size);
+		St.modified++;
+		St.cy += first_size;
+	}
+	else{
+		// the text after the cursor moves to the end of the last pasted line
+		long last_size = sizes[n-1];
+		lines[n-1] = text_realloc(lines[n-1], last_size + tail_size + 1);
+		memcpy(lines[n-1] + last_size, row->characters + St.cy, tail_size + 1);
+		sizes[n-1] += tail_size;
+
+		journal_delete(St.cx, St.cy, tail_size);
+		journal_insert(St.cx, St.cy, first, first_size);
+		undo_delete(St.cx, St.cy, tail_size);
+		undo_insert(St.cx, St.cy, first_size);
+		row->characters = text_realloc(row->characters, St.cy + first_size + 1);
+		memcpy(row->characters + St.cy, first, first_size);
+		editor_update_row_span(St.cx, St.cy, tail_size, first_size);
+		row->size = St.cy + first_size;
+		row->characters[row->size] = '\0';
+
+		editor_insert_rows(St.cx + 1, lines, sizes, n); //invalidates row
+		St.cx += n;
+		St.cy = last_size;
+	}
+	xfree(lines);
+	xfree(sizes);
+}
+
+void editor_paste(){
+	struct appendable_str paste = INIT_APPENDABLE_STR
+	input_read_paste(&paste);
+	editor_insert_text_at_cursor(paste.buf, paste.len);
+	xfree(paste.buf);
+}
+
+void editor_delete_character_at_cursor(){
+	if(cursor_below_last_line()) return;
+
+	erow *row = editor_row(St.cx);
+	if(St.cx == St.num_rows - 1 && St.cy == row->size) return; //Cursor at bottom right
+
+	if(St.cy == row->size){
+		editor_gap_close();
+		erow *next = editor_row(St.cx + 1);
+		editor_row_append_string(St.cx, next->characters, next->size);
+		editor_delete_row(St.cx+1);
+	}
+	else{
+		editor_row_delete_character(St.cx, St.cy);
+	}
+
+}
+
+/*  --- file io --- */ 
+
+void editor_open(const char *filename){
+	xfree(St.file_name);
+	St.file_name = strdup(filename);
+
+	editor_select_syntax_highlight();
+
+	int fd = open(filename, O_RDONLY);
+	if(fd == -1) die("editor_open");
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && map_open(fd, st.st_size) == 0){
+		close(fd);
+		if(St.map.lines > 0){
+			St.rows = row_piece_new(true);
+			St.rows->lines = St.rows->total = St.map.lines;
+			St.num_rows = St.map.lines;
+		}
+		St.modified = 0;
+		return;
+	}
+
+	FILE *file = fdopen(fd, "r");
+	if(file == NULL) die("editor_open");
+
+	char *line = NULL;
+	size_t linecap = 0;
+	long linelen;
+
+	while((linelen = getline(&line, &linecap, file)) != -1){
+		while(linelen > 0 && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
+			linelen--;
+		editor_insert_row(St.num_rows, text_dup(line, linelen));
+	}
+	xfree(line);
+	fclose(file);
+	St.modified = 0;
+}
+
+/* Files are written to a temporary file next to them, given the old one's
+ * owner and mode, synced and renamed over it, so a crash leaves either the
+ * old file or the new one. A file with other hard links, or one whose
+ * directory won't take the temporary file or whose owner it can't be
+ * given, is written over in place instead, cut to length and synced; the
+ * mapping is detached from it first. Rows are written straight from where
+ * they live with writev(), in batches of SAVE_IOV_BATCH pieces; rows that
+ * lie back to back in the mapping, newlines and all, go out as one
+ * piece. */
+
+#define SAVE_IOV_BATCH 1024
+
+struct save_batch{
+	int fd;
+	struct iovec iov[SAVE_IOV_BATCH];
+	int n;
+	long written;
+};
+
+bool save_flush(struct save_batch *b){
+	struct iovec *iov = b->iov;
+	int n = b->n;
+	while(n > 0){
+		ssize_t w = writev(b->fd, iov, n);
+		if(w < 0){
+			if(errno == EINTR) continue;
+			return false;
+		}
+		b->written += w;
+		while(n > 0 && (size_t)w >= iov->iov_len){
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if(n > 0){
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	b->n = 0;
+	return true;
+}
+
+bool save_put(struct save_batch *b, const char *s, long len){
+	if(b->n > 0){
+		struct iovec *last = b->iov + b->n - 1;
+		if((const char *)last->iov_base + last->iov_len == s){
+			last->iov_len += len;
+			return true;
+		}
+	}
+	if(b->n == SAVE_IOV_BATCH && !save_flush(b)) return false;
+	b->iov[b->n].iov_base = (char *)s;
+	b->iov[b->n].iov_len = len;
+	b->n++;
+	return true;
+}
+
+bool save_rows(struct save_batch *b){
+	struct row_iter it;
+	const char *map_end = St.map.data + St.map.size;
+	for(bool more = row_iter_seek(&it, 0); more; more = row_iter_step(&it, 1)){
+		long len;
+		const char *text = row_iter_text(&it, &len);
+		bool in_map = St.map.data && text >= St.map.data && text + len < map_end;
+		if(in_map && text[len] == '\n'){
+			if(!save_put(b, text, len + 1)) return false;
+		}
+		else if(!save_put(b, text, len) || !save_put(b, "\n", 1)){
+			return false;
+		}
+	}
+	return save_flush(b);
+}
+
+/* Writes the rows over the file at path. Returns the bytes written, or -1
+ * with errno set. */
+long editor_write_in_place(const char *path){
+	if(map_detach() == -1) return -1;
+	int fd = open(path, O_WRONLY);
+	if(fd == -1) return -1;
+	struct save_batch b = { .fd = fd };
+	bool ok = save_rows(&b) && ftruncate(fd, b.written) == 0 && fsync(fd) == 0;
+	int err = errno;
+	if(close(fd) == -1 && ok){
+		ok = false;
+		err = errno;
+	}
+	errno = err;
+	return ( ok ? b.written : -1 );
+}
+
+/* Writes the rows to path. Returns the bytes written, or -1 with errno
+ * set. */
+long editor_write_file(const char *path){
+	char *real = realpath(path, NULL);    // write through a symlink, not over it
+	if(real) path = real;
+
+	struct stat st;
+	mode_t mode;
+	bool exists = stat(path, &st) == 0;
+	if(exists){
+		mode = st.st_mode & 07777;
+	}
+	else{
+		mode_t mask = umask(0);
+		umask(mask);
+		mode = 0644 & ~mask;
+	}
+
+	const char *slash = strrchr(path, '/');
+	int dir_len = ( slash ? slash - path + 1 : 0 );
+	char *tmp = xmalloc(strlen(path) + 16);
+	if(tmp == NULL) die("malloc");
+	sprintf(tmp, "%.*s.%s.XXXXXX", dir_len, path, path + dir_len);
+
+	long written = -1;
+	editor_gap_close();
+	int fd = -1;
+	bool in_place = exists && st.st_nlink > 1;    // a rename would split it from its other links
+	if(!in_place){
+		fd = mkstemp(tmp);
+		in_place = exists && fd == -1 && (errno == EACCES || errno == EPERM || errno == EROFS);
+	}
+	if(fd != -1 && exists && fchown(fd, st.st_uid, st.st_gid) == -1){
+		close(fd);
+		unlink(tmp);
+		fd = -1;
+		in_place = true;
+	}
+	if(in_place){
+		written = editor_write_in_place(path);
+	}
+	else if(fd != -1){
+		struct save_batch b = { .fd = fd };
+		bool ok = fchmod(fd, mode) == 0 && save_rows(&b) && fsync(fd) == 0;
+		int err = errno;
+		if(close(fd) == -1 && ok){
+			ok = false;
+			err = errno;
+		}
+		if(ok && rename(tmp, path) == 0){
+			written = b.written;
+			// make the rename itself durable
+			char *dir = ( dir_len ? strndup(path, dir_len) : strdup(".") );
+			int dfd = ( dir ? open(dir, O_RDONLY | O_DIRECTORY) : -1 );
+			if(dfd != -1){
+				fsync(dfd);
+				close(dfd);
+			}
+			xfree(dir);
+		}
+		else{
+			if(ok) err = errno;
+			unlink(tmp);
+			errno = err;
+		}
+	}
+	int err = errno;
+	xfree(tmp);
+	xfree(real);
+	errno = err;
+	return written;
+}
+
+void editor_save_file(){
+	if(St.file_name == NULL) {
+		St.file_name = editor_prompt("Save as : %s  (Cancel = Esc)", NULL, false);
+		editor_select_syntax_highlight();
+	}
+	if(St.file_name == NULL) {
+		editor_set_status_message("Save aborted");
+		return;
+	}
+
+	long len = editor_write_file(St.file_name);
+	if(len < 0){
+		editor_set_status_message("SAVE FAILED. I/O error: %s", strerror(errno));
+		return;
+	}
+	editor_set_status_message("FILE SAVED. %ld bytes written.", len);
+	St.modified = 0;
+	undo_saved();
+	journal_start(false);
+}
+
+/* --- journal --- */
+
+/* Every edit since the last save is logged to a journal next to the file,
+ * so that a session which dies can be replayed on the next open. The row
+ * functions log each edit as a small record in memory, with runs of
+ * typing or deleting folded into one record, and nothing touches the disk
+ * while a key is handled. JOURNAL_COMMIT_MS after the first edit of a
+ * group, TIMER_JOURNAL hands the group to a writer thread that appends it
+ * and fdatasync()s. A save starts the journal over and quitting removes it.
+ *
+ * The journal starts with JOURNAL_MAGIC and the size and mtime of the file
+ * its edits apply to. Then come records, an op byte and its fields, with
+ * every number a varint:
+ *   'i' line at len bytes    insert bytes into a row
+ *   'd' line at len          delete characters from a row
+ *   'r' line len bytes       insert a row
+ *   'x' line                 delete a row
+ *   'X' line n               delete n rows
+ *   's' line len bytes       set the text of a row */
+
+#define JOURNAL_MAGIC "SEDITJ1\n"
+#define JOURNAL_COMMIT_MS 1000
+
+void journal_put_varint(struct appendable_str *to, unsigned long long v){
+	char b[10];
+	int n = 0;
+	do{
+		b[n] = v & 0x7f;
+		v >>= 7;
+		if(v) b[n] |= 0x80;
+		n++;
+	} while(v);
+	append(to, b, n);
+}
+
+bool journal_get_varint(const char *data, long len, long *at, unsigned long long *v){
+	*v = 0;
+	for(int shift = 0; *at < len && shift < 64; shift += 7){
+		unsigned char b = data[(*at)++];
+		*v |= (unsigned long long)(b & 0x7f) << shift;
+		if(!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+char *journal_path(const char *file){
+	const char *slash = strrchr(file, '/');
+	int dir_len = ( slash ? slash - file + 1 : 0 );
+	char *path = xmalloc(strlen(file) + 32);
+	if(path == NULL) die("malloc");
+	sprintf(path, "%.*s.%s.sedit-journal", dir_len, file, file + dir_len);
+	return path;
+}
+
+void journal_flush_pending(){
+	struct journal *j = &St.journal;
+	if(!j->pend_op) return;
+	if(j->pend_len > 0){
+		append(&j->buf, &j->pend_op, 1);
+		journal_put_varint(&j->buf, j->pend_line);
+		journal_put_varint(&j->buf, j->pend_at);
+		journal_put_varint(&j->buf, j->pend_len);
+		if(j->pend_op == 'i') append(&j->buf, j->pend_text.buf, j->pend_text.len);
+	}
+	j->pend_text.len = 0;
+	j->pend_op = 0;
+}
+
+/* Arms the commit for the first edit since the last one. */
+void journal_touch(){
+	if(St.timers[TIMER_JOURNAL] == 0) editor_timer_set(TIMER_JOURNAL, JOURNAL_COMMIT_MS);
+}
+
+void journal_insert(long line, long at, const char *s, long len){
+	struct journal *j = &St.journal;
+	if(!j->on || len == 0) return;
+	if(j->pend_op != 'i' || j->pend_line != line || j->pend_at + j->pend_len != at){
+		journal_flush_pending();
+		j->pend_op = 'i';
+		j->pend_line = line;
+		j->pend_at = at;
+		j->pend_len = 0;
+	}
+	append(&j->pend_text, s, len);
+	j->pend_len += len;
+	journal_touch();
+}
+
+void journal_delete(long line, long at, long len){
+	struct journal *j = &St.journal;
+	if(!j->on || len == 0) return;
+	if(j->pend_op == 'i' && j->pend_line == line && at >= j->pend_at && at + len == j->pend_at + j->pend_len){
+		// taking back the end of what was just typed
+		j->pend_len -= len;
+		j->pend_text.len -= len;
+	}
+	else if(j->pend_op == 'd' && j->pend_line == line && (at == j->pend_at || at + len == j->pend_at)){
+		j->pend_at = at;
+		j->pend_len += len;
+	}
+	else{
+		journal_flush_pending();
+		j->pend_op = 'd';
+		j->pend_line = line;
+		j->pend_at = at;
+		j->pend_len = len;
+	}
+	journal_touch();
+}
+
+/* Logs a row insert, delete or set; s is ignored for deletes, and so is
+ * len unless it is the number of rows an 'X' deletes. */
+void journal_row(char op, long line, const char *s, long len){
+	struct journal *j = &St.journal;
+	if(!j->on) return;
+	journal_flush_pending();
+	append(&j->buf, &op, 1);
+	journal_put_varint(&j->buf, line);
+	if(op != 'x') journal_put_varint(&j->buf, len);
+	if(op != 'x' && op != 'X') append(&j->buf, s, len);
+	journal_touch();
+}
+
+/* Appends and syncs whatever has been handed over. */
+void journal_write_out(){
+	struct journal *j = &St.journal;
+	pthread_mutex_lock(&j->lock);
+	struct appendable_str data = j->out;
+	j->out.buf = NULL;
+	j->out.len = j->out.cap = 0;
+	bool ok = !j->failed;
+	j->busy = true;
+	pthread_mutex_unlock(&j->lock);
+
+	if(ok && j->fd < 0){
+		j->fd = open(j->path, O_WRONLY | O_CREAT | O_APPEND | ( j->append ? 0 : O_TRUNC ), 0600);
+		ok = j->fd >= 0;
+	}
+	for(long off = 0; ok && off < data.len; ){
+		ssize_t w = write(j->fd, data.buf + off, data.len - off);
+		if(w < 0 && errno != EINTR) ok = false;
+		else if(w > 0) off += w;
+	}
+	if(ok && data.len) ok = fdatasync(j->fd) == 0;
+	xfree(data.buf);
+
+	pthread_mutex_lock(&j->lock);
+	if(!ok) j->failed = true;
+	j->busy = false;
+	pthread_cond_broadcast(&j->idle);
+	pthread_mutex_unlock(&j->lock);
+}
+
+void *journal_writer(void *arg){
+	(void)arg;
+	struct journal *j = &St.journal;
+	while(1){
+		pthread_mutex_lock(&j->lock);
+		while(j->out.len == 0) pthread_cond_wait(&j->wake, &j->lock);
+		pthread_mutex_unlock(&j->lock);
+		journal_write_out();
+	}
+	return NULL;
+}
+
+/* Hands the records logged since the last commit to the writer. */
+void journal_commit(){
+	struct journal *j = &St.journal;
+	if(!j->on) return;
+	journal_flush_pending();
+	if(j->buf.len == 0) return;
+
+	pthread_mutex_lock(&j->lock);
+	if(j->out.len == 0){
+		struct appendable_str t = j->out;
+		j->out = j->buf;
+		j->buf = t;
+	}
+	else{
+		append(&j->out, j->buf.buf, j->buf.len);
+	}
+	j->buf.len = 0;
+	bool failed = j->failed;
+	pthread_cond_signal(&j->wake);
+	pthread_mutex_unlock(&j->lock);
+
+	if(!j->writer_running){
+		if(pthread_create(&j->writer, NULL, journal_writer, NULL) == 0) j->writer_running = true;
+		else journal_write_out();
+	}
+	if(failed && !j->warned){
+		editor_set_status_message("Journal could not be written, changes can't be recovered after a crash");
+		j->warned = true;
+	}
+}
+
+/* Waits for the writer and closes and removes the journal file. */
+void journal_remove(){
+	struct journal *j = &St.journal;
+	if(j->path == NULL) return;
+	pthread_mutex_lock(&j->lock);
+	while(j->busy) pthread_cond_wait(&j->idle, &j->lock);
+	if(j->fd >= 0) close(j->fd);
+	j->fd = -1;
+	j->out.len = 0;
+	j->failed = false;
+	unlink(j->path);
+	pthread_mutex_unlock(&j->lock);
+}
+
+/* Starts logging edits to St.file_name as it is on disk now, in a new
+ * journal, or after what the journal already holds when `keep` is set. */
+void journal_start(bool keep){
+	struct journal *j = &St.journal;
+	struct stat st;
+	j->on = false;
+	j->buf.len = 0;
+	j->pend_op = 0;
+	j->pend_text.len = 0;
+	editor_timer_cancel(TIMER_JOURNAL);
+	if(St.file_name == NULL || stat(St.file_name, &st) != 0) return;
+
+	if(j->path == NULL) j->path = journal_path(St.file_name);
+	if(!keep) journal_remove();
+	j->append = keep;
+	if(!keep){
+		append(&j->buf, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+		journal_put_varint(&j->buf, st.st_size);
+		journal_put_varint(&j->buf, st.st_mtim.tv_sec);
+		journal_put_varint(&j->buf, st.st_mtim.tv_nsec);
+	}
+	j->on = true;
+}
+
+/* Stops logging for good; the edits are being thrown away. */
+void journal_discard(){
+	journal_remove();
+	St.journal.on = false;
+}
+
+/* Applies the records in data[at, len). Returns where the whole, valid
+ * records end and sets *edits to how many there were. */
+long journal_replay(const char *data, long len, long at, long *edits){
+	*edits = 0;
+	while(at < len){
+		long start = at;
+		char op = data[at++];
+		unsigned long long line, pos = 0, n = 0;
+		if(!journal_get_varint(data, len, &at, &line)) return start;
+		if(op == 'i' || op == 'd'){
+			if(!journal_get_varint(data, len, &at, &pos)) return start;
+		}
+		if(op != 'x'){
+			if(!journal_get_varint(data, len, &at, &n)) return start;
+		}
+		bool has_text = op == 'i' || op == 'r' || op == 's';
+		if(has_text && n > (unsigned long long)(len - at)) return start;
+
+		long size = ( line < (unsigned long long)St.num_rows ? editor_row(line)->size : -1 );
+		switch(op){
+			case 'i':
+				if(size < 0 || pos > (unsigned long long)size) return start;
+				editor_row_insert_text(line, pos, data + at, n);
+				break;
+			case 'd':
+				if(size < 0 || pos > (unsigned long long)size || n > size - pos) return start;
+				editor_row_delete_text(line, pos, n);
+				break;
+			case 'r':
+				if(line > (unsigned long long)St.num_rows) return start;
+				editor_insert_row(line, text_dup(data + at, n));
+				break;
+			case 'x':
+				if(size < 0) return start;
+				editor_delete_row(line);
+				break;
+			case 'X':
+				if(line > (unsigned long long)St.num_rows || n > St.num_rows - line) return start;
+				for(unsigned long long k = 0; k < n; k++) editor_delete_row(line);
+				break;
+			case 's':
+				if(size < 0) return start;
+				editor_row_set_text(line, text_dup(data + at, n), n);
+				break;
+			default:
+				return start;
+		}
+		if(has_text) at += n;
+		(*edits)++;
+	}
+	return at;
+}
+
+/* Offers to replay a journal left by a session that didn't quit, then
+ * starts logging. */
+void journal_recover(){
+	struct journal *j = &St.journal;
+	if(St.file_name == NULL) return;
+	j->path = journal_path(St.file_name);
+
+	struct stat st, jst;
+	int fd = open(j->path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &jst) != 0 || stat(St.file_name, &st) != 0){
+		if(fd >= 0) close(fd);
+		journal_start(false);
+		return;
+	}
+	char *data = xmalloc(jst.st_size + 1);
+	if(data == NULL) die("malloc");
+	long len = 0;
+	for(ssize_t r; len < jst.st_size && (r = read(fd, data + len, jst.st_size - len)) > 0; ) len += r;
+	close(fd);
+
+	long at = strlen(JOURNAL_MAGIC);
+	unsigned long long size, sec, nsec;
+	bool valid = len >= at && memcmp(data, JOURNAL_MAGIC, at) == 0 &&
+		journal_get_varint(data, len, &at, &size) && journal_get_varint(data, len, &at, &sec) &&
+		journal_get_varint(data, len, &at, &nsec);
+	bool matches = valid && size == (unsigned long long)st.st_size &&
+		sec == (unsigned long long)st.st_mtim.tv_sec && nsec == (unsigned long long)st.st_mtim.tv_nsec;
+
+	int key = 'n';
+	if(matches && at < len){
+		editor_set_status_message("Unsaved changes from a session that didn't quit were found. Recover them? (y/n)");
+		editor_timer_cancel(TIMER_STATUS_MESSAGE);
+		do{
+			editor_refresh_screen();
+			key = editor_read_key();
+		} while(key != 'y' && key != 'n' && key != ESC);
+	}
+	else if(valid && at < len){
+		// the file changed after the journal was written, so it can't apply
+		char *old = xmalloc(strlen(j->path) + 2);
+		if(old == NULL) die("malloc");
+		sprintf(old, "%s~", j->path);
+		rename(j->path, old);
+		editor_set_status_message("Journal is older than the file, kept as %s", old);
+		xfree(old);
+	}
+
+	if(key == 'y'){
+		long edits;
+		long end = journal_replay(data, len, at, &edits);
+		// later records go after the last whole one
+		if(end < len) truncate(j->path, end);
+		editor_set_status_message("Recovered %ld edits", edits);
+		journal_start(true);
+	}
+	else{
+		journal_start(false);
+	}
+	xfree(data);
+}
+
+/* --- undo --- */
+
+/* Edits are logged in St.undo so they can be undone and redone. The row
+ * functions record each edit as an op as it is made, and the ops recorded
+ * while one key is handled form a group that is undone as a unit. Typing
+ * or deleting one character next to the last keystroke grows its op
+ * instead of adding one. An op only holds text that is no longer in the
+ * buffer: an insert holds nothing until it is undone, a deleted row or a
+ * replaced row text is kept as the block the row owned, or as a pointer
+ * into the mapping, and undoing an insert of many rows cuts them out of
+ * the row tree in one piece and keeps that. The log holds at most
+ * St.undo.budget bytes, dropping the oldest groups when it grows past it.
+ * The budget is SEDIT_UNDO_BUDGET_MB megabytes unless the environment
+ * variable of that name says otherwise. */
+
+#ifndef SEDIT_UNDO_BUDGET_MB
+#define SEDIT_UNDO_BUDGET_MB 64
+#endif
+
+bool undo_recording(){
+	return St.undo.on && !St.undo.replaying && !St.undo.overflow;
+}
+
+long undo_text_cost(const char *text, bool mapped){
+	return ( text && !mapped ? text_capacity(text) + 1 : 0 );
+}
+
+void undo_set_cost(struct undo_op *op, long cost){
+	St.undo.bytes += cost - op->cost;
+	op->cost = cost;
+}
+
+void undo_release(struct undo_op *op){
+	if(op->text && !op->mapped) text_free(op->text);
+	row_piece_free_all(op->rows);
+	op->text = NULL;
+	op->rows = NULL;
+	undo_set_cost(op, 0);
+}
+
+void undo_drop(struct undo_op *op){
+	undo_release(op);
+	St.undo.bytes -= sizeof(struct undo_op);
+}
+
+/* Copies characters [at, at + len) of row, which may hold the gap. */
+void undo_copy_out(erow *row, long at, long len, char *to){
+	const char *runs[2] = { NULL, NULL };
+	long lens[2] = { 0, 0 };
+	int nruns = editor_row_runs(row, runs, lens);
+	for(int k = 0; k < nruns && len > 0; k++){
+		if(at >= lens[k]){
+			at -= lens[k];
+			continue;
+		}
+		long n = ( lens[k] - at < len ? lens[k] - at : len );
+		memcpy(to, runs[k] + at, n);
+		to += n;
+		len -= n;
+		at = 0;
+	}
+}
+
+/* Drops the oldest groups until the log is back under three quarters of
+ * its budget, keeping the group being recorded unless it alone is over
+ * the budget. */
+void undo_trim(){
+	struct undo_log *u = &St.undo;
+	if(u->bytes <= u->budget) return;
+
+	long group = u->n - 1;
+	while(group > 0 && !u->ops[group].first) group--;
+	long k = 0;
+	while(k < group && u->bytes > u->budget - u->budget / 4){
+		do undo_drop(&u->ops[k++]);
+		while(k < group && !u->ops[k].first);
+	}
+	if(u->bytes > u->budget){
+		while(k < u->n) undo_drop(&u->ops[k++]);
+		u->overflow = true;
+		u->saved = -1;
+	}
+
+	memmove(u->ops, u->ops + k, sizeof(struct undo_op) * (u->n - k));
+	u->n -= k;
+	u->cur -= k;
+	u->start += k;
+}
+
+/* Adds an op for an edit about to be made, throwing away what could have
+ * been redone. */
+struct undo_op *undo_push(enum undo_kind kind, long line){
+	struct undo_log *u = &St.undo;
+	for(long k = u->cur; k < u->n; k++) undo_drop(&u->ops[k]);
+	u->n = u->cur;
+	if(u->saved > u->start + u->cur) u->saved = -1;
+
+	if(u->n == u->cap){
+		long cap = ( u->cap ? u->cap * 2 : 64 );
+		u->ops = xrealloc(u->ops, sizeof(struct undo_op) * cap);
+		if(u->ops == NULL) die("realloc");
+		u->cap = cap;
+	}
+	u->bytes += sizeof(struct undo_op);
+	struct undo_op *op = &u->ops[u->n++];
+	memset(op, 0, sizeof(*op));
+	op->kind = kind;
+	op->first = !u->open;
+	op->line = line;
+	u->cur = u->n;
+	u->open = true;
+	u->merge = false;
+	return op;
+}
+
+/* The op a keystroke may fold into. */
+struct undo_op *undo_last(){
+	struct undo_log *u = &St.undo;
+	return ( u->merge && u->cur == u->n && u->n > 0 ? &u->ops[u->n - 1] : NULL );
+}
+
+void undo_insert(long line, long at, long len){
+	struct undo_log *u = &St.undo;
+	if(!undo_recording() || len == 0) return;
+	struct undo_op *last = undo_last();
+	if(last && len == 1 && last->kind == UNDO_INSERT && last->line == line && last->at + last->len == at){
+		last->len++;
+		u->open = true;
+		return;
+	}
+	struct undo_op *op = undo_push(UNDO_INSERT, line);
+	op->at = at;
+	op->len = len;
+	u->merge = len == 1;
+	undo_trim();
+}
+
+/* Records characters [at, at + len) of row `line` before they are deleted. */
+void undo_delete(long line, long at, long len){
+	struct undo_log *u = &St.undo;
+	if(!undo_recording() || len == 0) return;
+	erow *row = editor_row(line);
+	struct undo_op *last = undo_last();
+	if(last && len == 1 && last->line == line){
+		if(last->kind == UNDO_INSERT && at == last->at + last->len - 1){
+			// taking back the end of what was just typed
+			if(--last->len > 0){
+				u->open = true;
+				return;
+			}
+			u->n = --u->cur;
+			u->bytes -= sizeof(struct undo_op);
+			u->open = !last->first;
+			u->merge = false;
+			return;
+		}
+		bool forward = at == last->at && !last->backward;
+		bool backward = at + 1 == last->at && (last->backward || last->len == 1);
+		if(last->kind == UNDO_DELETE && (forward || backward)){
+			last->text = text_realloc(last->text, last->len + 2);
+			undo_copy_out(row, at, 1, last->text + last->len++);
+			last->text[last->len] = '\0';
+			if(backward){
+				last->backward = true;
+				last->at = at;
+			}
+			undo_set_cost(last, undo_text_cost(last->text, false));
+			u->open = true;
+			undo_trim();
+			return;
+		}
+	}
+	struct undo_op *op = undo_push(UNDO_DELETE, line);
+	op->at = at;
+	op->len = len;
+	op->text = text_alloc(len + 1);
+	undo_copy_out(row, at, len, op->text);
+	op->text[len] = '\0';
+	undo_set_cost(op, undo_text_cost(op->text, false));
+	u->merge = len == 1;
+	undo_trim();
+}
+
+void undo_rows_in(long line, long n){
+	struct undo_log *u = &St.undo;
+	if(!undo_recording()) return;
+	struct undo_op *last = ( u->open && u->cur == u->n && u->n > 0 ? &u->ops[u->n - 1] : NULL );
+	if(last && last->kind == UNDO_ROWS_IN && line == last->line + last->n){
+		last->n += n;
+		return;
+	}
+	struct undo_op *op = undo_push(UNDO_ROWS_IN, line);
+	op->n = n;
+	undo_trim();
+}
+
+/* Takes over the text of row `line`, which is about to be deleted. */
+void undo_row_out(long line, erow *row){
+	if(!undo_recording()) return;
+	editor_gap_close();
+	struct undo_op *op = undo_push(UNDO_ROWS_OUT, line);
+	op->n = 1;
+	op->text = row->characters;
+	op->len = row->size;
+	op->mapped = row->mapped;
+	row->characters = NULL;
+	undo_set_cost(op, undo_text_cost(op->text, op->mapped));
+	undo_trim();
+}
+
+/* Takes over the text of row `line`, which is about to be replaced.
+ * Returns false if the caller still owns it. */
+bool undo_set(long line, erow *row){
+	if(!undo_recording()) return false;
+	struct undo_op *op = undo_push(UNDO_SET, line);
+	op->text = row->characters;
+	op->len = row->size;
+	op->mapped = row->mapped;
+	undo_set_cost(op, undo_text_cost(op->text, op->mapped));
+	undo_trim();
+	return true;
+}
+
+/* Starts a new group for the next edit. */
+void undo_boundary(){
+	St.undo.open = false;
+	St.undo.overflow = false;
+}
+
+void undo_saved(){
+	St.undo.saved = St.undo.start + St.undo.cur;
+	St.undo.merge = false;
+}
+
+void undo_take_rows(struct undo_op *op){
+	long cost;
+	if(op->n == 1){
+		editor_gap_close();
+		erow *row = editor_row(op->line);
+		op->text = row->characters;
+		op->len = row->size;
+		op->mapped = row->mapped;
+		row->characters = NULL;
+		editor_delete_row(op->line);
+		cost = undo_text_cost(op->text, op->mapped);
+	}
+	else{
+		op->rows = editor_cut_rows(op->line, op->n, &cost);
+	}
+	undo_set_cost(op, cost);
+}
+
+void undo_put_rows(struct undo_op *op){
+	if(op->rows) editor_splice_rows(op->line, op->rows);
+	else editor_insert_row_text(op->line, op->text, op->len, op->mapped);
+	op->text = NULL;
+	op->rows = NULL;
+	undo_set_cost(op, 0);
+}
+
+/* Undoes op, or makes it again when `redo` is set, and puts the cursor
+ * where it happened. */
+void undo_apply(struct undo_op *op, bool redo){
+	bool out = ( op->kind == UNDO_INSERT || op->kind == UNDO_ROWS_IN ) != redo;
+	St.cx = op->line;
+	St.cy = 0;
+	switch(op->kind){
+		case UNDO_INSERT:
+		case UNDO_DELETE:
+			if(out){
+				if(op->kind == UNDO_INSERT){
+					op->text = text_alloc(op->len + 1);
+					undo_copy_out(editor_row(op->line), op->at, op->len, op->text);
+					op->text[op->len] = '\0';
+					undo_set_cost(op, undo_text_cost(op->text, false));
+				}
+				editor_row_delete_text(op->line, op->at, op->len);
+				St.cy = op->at;
+			}
+			else{
+				bool backward = op->backward;
+				if(backward){
+					for(long i = 0, j = op->len - 1; i < j; i++, j--){
+						char c = op->text[i];
+						op->text[i] = op->text[j];
+						op->text[j] = c;
+					}
+					op->backward = false;
+				}
+				editor_row_insert_text(op->line, op->at, op->text, op->len);
+				St.cy = op->at + ( redo || backward ? op->len : 0 );
+				if(op->kind == UNDO_INSERT) undo_release(op);
+			}
+			break;
+
+		case UNDO_ROWS_IN:
+		case UNDO_ROWS_OUT:
+			if(out) undo_take_rows(op);
+			else undo_put_rows(op);
+			if(redo && op->kind == UNDO_ROWS_IN) St.cx += op->n - 1;
+			break;
+
+		case UNDO_SET:{
+			editor_gap_close();
+			erow *row = editor_row(op->line);
+			char *text = row->characters;
+			long size = row->size;
+			bool mapped = row->mapped;
+			journal_row('s', op->line, op->text, op->len);
+			row->characters = op->text;
+			row->size = op->len;
+			row->mapped = op->mapped;
+			op->text = text;
+			op->len = size;
+			op->mapped = mapped;
+			undo_set_cost(op, undo_text_cost(op->text, op->mapped));
+			editor_update_row(op->line);
+			St.modified++;
+			break;
+		}
+	}
+}
+
+/* Leaves the cursor somewhere real and the buffer unmodified if it is
+ * back to what was saved. */
+void undo_settle(){
+	struct undo_log *u = &St.undo;
+	u->replaying = false;
+	u->open = false;
+	u->merge = false;
+	if(u->start + u->cur == u->saved) St.modified = 0;
+	if(St.cx > St.num_rows) St.cx = St.num_rows;
+	erow *row = editor_row(St.cx);
+	long len = ( row ? row->size : 0 );
+	if(St.cy > len) St.cy = len;
+}
+
+void editor_undo(){
+	struct undo_log *u = &St.undo;
+	if(u->cur == 0){
+		editor_set_status_message("Nothing to undo");
+		return;
+	}
+	u->replaying = true;
+	struct undo_op *op;
+	do{
+		op = &u->ops[--u->cur];
+		undo_apply(op, false);
+	} while(!op->first && u->cur > 0);
+	undo_settle();
+}
+
+void editor_redo(){
+	struct undo_log *u = &St.undo;
+	if(u->cur == u->n){
+		editor_set_status_message("Nothing to redo");
+		return;
+	}
+	u->replaying = true;
+	do undo_apply(&u->ops[u->cur++], true);
+	while(u->cur < u->n && !u->ops[u->cur].first);
+	undo_settle();
+}
+
+/* --- regex --- */
+
+/* Regular expressions for search: literal bytes, ., [classes] with ranges
+ * and ^ negation, \d \w \s and their capitals, \ escapes, ^ and $, groups,
+ * alternation, and * + ? {m} {m,} {m,n}. A pattern is parsed into a tree
+ * that is compiled into two Thompson programs, one for the pattern and one
+ * for it reversed. Those run as DFAs whose states are built the first time
+ * the text reaches them and kept in a regex_dfa, so once warm each byte
+ * costs one table lookup and nothing ever backtracks. A line is read as
+ * BOL, its bytes, then EOL. Those two consume nothing: reading one keeps
+ * every instruction a state is at and lets the ^ or $ assertions waiting
+ * for it through, so ^^ and $[ab]*$ match as they should.
+ *
+ * Matches are leftmost-longest. One backwards pass over a line with the
+ * reversed program marks every position a match starts at, and from the
+ * first of those at or after the search position the forward program runs
+ * to where the longest match ends. */
+
+#define RX_SYMBOLS 258
+#define RX_BOL 256
+#define RX_EOL 257
+#define RX_SET_WORDS ((RX_SYMBOLS + 63) / 64)
+#define RX_MAX_INSTS 20000
+#define RX_MAX_REPEAT 1000
+#define RX_DFA_MAX_STATES 2048
+
+enum regex_op{
+	RX_SET,      // consume a symbol in sets[set], go to x
+	RX_SPLIT,    // go to both x and y
+	RX_ASSERT,   // go to x once symbol set, RX_BOL or RX_EOL, has been read
+	RX_MATCH
+};
+
+struct regex_inst{
+	unsigned char op;
+	int set;
+	int x, y;
+};
+
+struct regex_prog{
+	struct regex_inst *inst;
+	int n, cap;
+	int start;
+};
+
+struct regex{
+	uint64_t (*sets)[RX_SET_WORDS];
+	int nsets;
+	short classes[RX_SYMBOLS];    // symbols that no set tells apart share a class
+	int nclasses;
+	struct regex_prog prog[2];    // forwards and reversed
+};
+
+enum regex_node_type{ RN_SET, RN_ASSERT, RN_EMPTY, RN_CAT, RN_ALT, RN_REPEAT };
+
+struct regex_node{
+	enum regex_node_type type;
+	int set;          // RX_BOL or RX_EOL for an RN_ASSERT
+	int min, max;     // max -1 for no limit
+	struct regex_node *a, *b;
+};
+
+struct regex_parser{
+	const char *s;
+	long len, i;
+	struct regex *re;
+	const char *error;
+};
+
+bool regex_set_has(const uint64_t *set, int sym){
+	return set[sym >> 6] >> (sym & 63) & 1;
+}
+
+void regex_set_add(uint64_t *set, int from, int to){
+	for(int sym = from; sym <= to; sym++) set[sym >> 6] |= 1ULL << (sym & 63);
+}
+
+/* Returns the index of a set equal to bits, adding it if there is none. */
+int regex_intern_set(struct regex *re, const uint64_t *bits){
+	for(int i = 0; i < re->nsets; i++)
+		if(memcmp(re->sets[i], bits, sizeof(re->sets[i])) == 0) return i;
+	re->sets = xrealloc(re->sets, sizeof(re->sets[0]) * (re->nsets + 1));
+	if(re->sets == NULL) die("realloc");
+	memcpy(re->sets[re->nsets], bits, sizeof(re->sets[0]));
+	return re->nsets++;
+}
+
+struct regex_node *regex_node_new(enum regex_node_type type, struct regex_node *a, struct regex_node *b){
+	struct regex_node *n = xcalloc(1, sizeof(struct regex_node));
+	if(n == NULL) die("calloc");
+	n->type = type;
+	n->a = a;
+	n->b = b;
+	return n;
+}
+
+void regex_node_free(struct regex_node *n){
+	if(n == NULL) return;
+	regex_node_free(n->a);
+	regex_node_free(n->b);
+	xfree(n);
+}
+
+/* Adds the bytes of a \d, \w or \s class to set, or their complement for
+ * the capital letters. Returns false if c names no class. */
+bool regex_escape_class(uint64_t *set, char c){
+	uint64_t bits[RX_SET_WORDS] = { 0 };
+	switch(tolower((unsigned char)c)){
+		case 'd': regex_set_add(bits, '0', '9'); break;
+		case 'w': regex_set_add(bits, '0', '9'); regex_set_add(bits, 'a', 'z'); regex_set_add(bits, 'A', 'Z'); regex_set_add(bits, '_', '_'); break;
+		case 's': regex_set_add(bits, ' ', ' '); regex_set_add(bits, '\t', '\r'); break;
+		default: return false;
+	}
+	for(int w = 0; w < RX_SET_WORDS; w++){
+		if(isupper((unsigned char)c)) bits[w] = ~bits[w];
+		set[w] |= bits[w];
+	}
+	set[RX_BOL >> 6] &= ~(3ULL << (RX_BOL & 63));    // never BOL or EOL
+	return true;
+}
+
+/* The byte an escape stands for. */
+unsigned char regex_escape_byte(char c){
+	switch(c){
+		case 't': return '\t';
+		case 'n': return '\n';
+		case 'r': return '\r';
+		default: return c;
+	}
+}
+
+struct regex_node *regex_parse_alt(struct regex_parser *p);
+
+struct regex_node *regex_parse_class(struct regex_parser *p){
+	uint64_t set[RX_SET_WORDS] = { 0 };
+	bool negate = p->i < p->len && p->s[p->i] == '^';
+	if(negate) p->i++;
+	bool first = true;
+	while(p->i < p->len && (p->s[p->i] != ']' || first)){
+		first = false;
+		int lo = (unsigned char)p->s[p->i++];
+		if(lo == '\\' && p->i < p->len){
+			char c = p->s[p->i++];
+			if(regex_escape_class(set, c)) continue;
+			lo = regex_escape_byte(c);
+		}
+		int hi = lo;
+		if(p->i + 1 < p->len && p->s[p->i] == '-' && p->s[p->i + 1] != ']'){
+			hi = (unsigned char)p->s[p->i + 1];
+			p->i += 2;
+			if(hi == '\\' && p->i < p->len) hi = regex_escape_byte(p->s[p->i++]);
+			if(hi < lo){
+				p->error = "bad range";
+				return NULL;
+			}
+		}
+		regex_set_add(set, lo, hi);
+	}
+	if(p->i == p->len){
+		p->error = "missing ]";
+		return NULL;
+	}
+	p->i++;
+	if(negate){
+		for(int w = 0; w < RX_SET_WORDS; w++) set[w] = ~set[w];
+		set[RX_BOL >> 6] &= ~(3ULL << (RX_BOL & 63));
+	}
+	struct regex_node *n = regex_node_new(RN_SET, NULL, NULL);
+	n->set = regex_intern_set(p->re, set);
+	return n;
+}
+
+struct regex_node *regex_parse_atom(struct regex_parser *p){
+	uint64_t set[RX_SET_WORDS] = { 0 };
+	char c = p->s[p->i++];
+	switch(c){
+		case '(': {
+			struct regex_node *n = regex_parse_alt(p);
+			if(p->error) return n;
+			if(p->i == p->len || p->s[p->i] != ')'){
+				p->error = "missing )";
+				return n;
+			}
+			p->i++;
+			return n;
+		}
+		case '[':
+			return regex_parse_class(p);
+		case '*': case '+': case '?':
+			p->error = "nothing to repeat";
+			return NULL;
+		case '.':
+			regex_set_add(set, 0, 255);
+			break;
+		case '^': case '$': {
+			struct regex_node *n = regex_node_new(RN_ASSERT, NULL, NULL);
+			n->set = ( c == '^' ? RX_BOL : RX_EOL );
+			return n;
+		}
+		case '\\':
+			if(p->i == p->len){
+				p->error = "trailing \\";
+				return NULL;
+			}
+			c = p->s[p->i++];
+			if(!regex_escape_class(set, c)){
+				c = regex_escape_byte(c);
+				regex_set_add(set, (unsigned char)c, (unsigned char)c);
+			}
+			break;
+		default:
+			regex_set_add(set, (unsigned char)c, (unsigned char)c);
+	}
+	struct regex_node *n = regex_node_new(RN_SET, NULL, NULL);
+	n->set = regex_intern_set(p->re, set);
+	return n;
+}
+
+/* Reads a {m}, {m,} or {m,n} at p->i. Returns false, reading nothing, if
+ * there isn't one there; the { is then an ordinary byte. */
+bool regex_parse_bounds(struct regex_parser *p, int *min, int *max){
+	long i = p->i + 1;
+	long m = 0, n;
+	if(i >= p->len || !isdigit((unsigned char)p->s[i])) return false;
+	while(i < p->len && isdigit((unsigned char)p->s[i]) && m <= RX_MAX_REPEAT) m = m * 10 + p->s[i++] - '0';
+	n = m;
+	if(i < p->len && p->s[i] == ','){
+		i++;
+		n = -1;
+		if(i < p->len && isdigit((unsigned char)p->s[i])){
+			n = 0;
+			while(i < p->len && isdigit((unsigned char)p->s[i]) && n <= RX_MAX_REPEAT) n = n * 10 + p->s[i++] - '0';
+		}
+	}
+	if(i >= p->len || p->s[i] != '}') return false;
+	if(m > RX_MAX_REPEAT || n > RX_MAX_REPEAT || (n >= 0 && n < m)){
+		p->error = "bad repeat";
+		return false;
+	}
+	p->i = i + 1;
+	*min = m;
+	*max = n;
+	return true;
+}
+
+struct regex_node *regex_parse_repeat(struct regex_parser *p){
+	struct regex_node *n = regex_parse_atom(p);
+	while(!p->error && p->i < p->len){
+		int min, max;
+		char c = p->s[p->i];
+		if(c == '*') { min = 0; max = -1; }
+		else if(c == '+') { min = 1; max = -1; }
+		else if(c == '?') { min = 0; max = 1; }
+		else if(c != '{' || !regex_parse_bounds(p, &min, &max)) break;
+		if(c != '{') p->i++;
+		n = regex_node_new(RN_REPEAT, n, NULL);
+		n->min = min;
+		n->max = max;
+	}
+	return n;
+}
+
+struct regex_node *regex_parse_cat(struct regex_parser *p){
+	struct regex_node *n = regex_node_new(RN_EMPTY, NULL, NULL);
+	while(!p->error && p->i < p->len && p->s[p->i] != '|' && p->s[p->i] != ')')
+		n = regex_node_new(RN_CAT, n, regex_parse_repeat(p));
+	return n;
+}
+
+struct regex_node *regex_parse_alt(struct regex_parser *p){
+	struct regex_node *n = regex_parse_cat(p);
+	while(!p->error && p->i < p->len && p->s[p->i] == '|'){
+		p->i++;
+		n = regex_node_new(RN_ALT, n, regex_parse_cat(p));
+	}
+	return n;
+}
+
+int regex_inst_new(struct regex_prog *prog, enum regex_op op, int set, int x, int y){
+	if(prog->n == prog->cap){
+		prog->cap = prog->cap ? prog->cap * 2 : 64;
+		prog->inst = xrealloc(prog->inst, sizeof(struct regex_inst) * prog->cap);
+		if(prog->inst == NULL) die("realloc");
+	}
+	prog->inst[prog->n] = (struct regex_inst){ op, set, x, y };
+	return prog->n++;
+}
+
+/* Emits the instructions for n ahead of those at next and returns where
+ * they start. Programs are built back to front, so each copy a repeat
+ * needs is just another emit. Gives up, returning next, once the program
+ * passes RX_MAX_INSTS. */
+int regex_emit(struct regex_prog *prog, struct regex_node *n, int next, bool reverse){
+	if(prog->n > RX_MAX_INSTS) return next;
+	switch(n->type){
+		case RN_SET:
+			return regex_inst_new(prog, RX_SET, n->set, next, -1);
+		case RN_ASSERT:
+			return regex_inst_new(prog, RX_ASSERT, n->set, next, -1);
+		case RN_EMPTY:
+			return next;
+		case RN_CAT:
+			if(reverse) return regex_emit(prog, n->b, regex_emit(prog, n->a, next, reverse), reverse);
+			return regex_emit(prog, n->a, regex_emit(prog, n->b, next, reverse), reverse);
+		case RN_ALT: {
+			int x = regex_emit(prog, n->a, next, reverse);
+			int y = regex_emit(prog, n->b, next, reverse);
+			return regex_inst_new(prog, RX_SPLIT, -1, x, y);
+		}
+		case RN_REPEAT: {
+			int at = next;
+			if(n->max < 0){
+				int loop = regex_inst_new(prog, RX_SPLIT, -1, -1, next);
+				int body = regex_emit(prog, n->a, loop, reverse);
+				prog->inst[loop].x = body;
+				at = loop;
+			}
+			else{
+				for(int k = n->min; k < n->max; k++)
+					at = regex_inst_new(prog, RX_SPLIT, -1, regex_emit(prog, n->a, at, reverse), next);
+			}
+			for(int k = 0; k < n->min; k++) at = regex_emit(prog, n->a, at, reverse);
+			return at;
+		}
+	}
+	return next;
+}
+
+void regex_free(struct regex *re){
+	if(re == NULL) return;
+	xfree(re->sets);
+	xfree(re->prog[0].inst);
+	xfree(re->prog[1].inst);
+	xfree(re);
+}
+
+/* Compiles pattern, or returns NULL and sets *error. */
+struct regex *regex_compile(const char *pattern, long len, const char **error){
+	struct regex *re = xcalloc(1, sizeof(struct regex));
+	if(re == NULL) die("calloc");
+	struct regex_parser p = { pattern, len, 0, re, NULL };
+	struct regex_node *tree = regex_parse_alt(&p);
+	if(!p.error && p.i < len) p.error = "unmatched )";
+
+	for(int d = 0; d < 2 && !p.error; d++){
+		struct regex_prog *prog = re->prog + d;
+		prog->start = regex_emit(prog, tree, regex_inst_new(prog, RX_MATCH, -1, -1, -1), d == 1);
+		if(prog->n > RX_MAX_INSTS) p.error = "pattern too big";
+	}
+	regex_node_free(tree);
+	if(p.error){
+		*error = p.error;
+		regex_free(re);
+		return NULL;
+	}
+
+	int rep[RX_SYMBOLS];
+	for(int sym = 0; sym < RX_SYMBOLS; sym++){
+		int c = ( sym < RX_BOL ? 0 : re->nclasses );    // BOL and EOL each get a class
+		for(; c < re->nclasses; c++){
+			int s = 0;
+			while(s < re->nsets && regex_set_has(re->sets[s], sym) == regex_set_has(re->sets[s], rep[c])) s++;
+			if(s == re->nsets) break;
+		}
+		if(c == re->nclasses) rep[re->nclasses++] = sym;
+		re->classes[sym] = c;
+	}
+	return re;
+}
+
+/* A DFA over one of the programs, built lazily. Each state is the set of
+ * instructions the program can be at, with the line edges read since the
+ * last byte, and its transitions start out as -1 and are filled in on
+ * first use. Once RX_DFA_MAX_STATES are built the
+ * cache is emptied and builds up again from the state in hand. */
+struct regex_dfa{
+	const struct regex *re;
+	const struct regex_prog *prog;
+	bool unanchored;      // a match may start at any symbol, not only the first
+	int *trans;           // nclasses for each state
+	bool *accept;
+	unsigned char *edges; // RX_EDGE() of the BOL and EOL read since the last byte
+	int *items;           // instructions of every state, back to back
+	long nitems, items_cap;
+	long *item_start;
+	int *item_len;
+	int *hash;            // state + 1 by hash of its items, 0 for none
+	int nstates, states_cap;
+	int start;            // -1 until built
+	int *mark, stamp;     // scratch for closures
+	int *stack, *buf;
+};
+
+struct regex_matcher{
+	const struct regex *re;
+	struct regex_dfa fwd, rev;
+	char *starts;         // where matches start in the last line scanned
+	long starts_cap;
+	const char *text;     // that line
+	long len;
+};
+
+void regex_dfa_init(struct regex_dfa *d, const struct regex *re, int prog, bool unanchored){
+	memset(d, 0, sizeof(*d));
+	d->re = re;
+	d->prog = re->prog + prog;
+	d->unanchored = unanchored;
+	d->start = -1;
+	d->hash = xcalloc(RX_DFA_MAX_STATES * 2, sizeof(int));
+	d->mark = xcalloc(d->prog->n, sizeof(int));
+	d->stack = xmalloc(sizeof(int) * d->prog->n);
+	d->buf = xmalloc(sizeof(int) * d->prog->n);
+	if(d->hash == NULL || d->mark == NULL || d->stack == NULL || d->buf == NULL) die("malloc");
+}
+
+void regex_dfa_free(struct regex_dfa *d){
+	xfree(d->trans);
+	xfree(d->accept);
+	xfree(d->edges);
+	xfree(d->items);
+	xfree(d->item_start);
+	xfree(d->item_len);
+	xfree(d->hash);
+	xfree(d->mark);
+	xfree(d->stack);
+	xfree(d->buf);
+}
+
+#define RX_EDGE(sym) (1 << ((sym) - RX_BOL))
+
+/* Adds to d->buf the instructions reachable from inst that wait on a
+ * symbol, passing the assertions for the line edges in `edges`. */
+void regex_dfa_closure(struct regex_dfa *d, int inst, int edges, int *n){
+	int top = 0;
+	d->stack[top++] = inst;
+	while(top){
+		int i = d->stack[--top];
+		if(d->mark[i] == d->stamp) continue;
+		d->mark[i] = d->stamp;
+		const struct regex_inst *in = d->prog->inst + i;
+		if(in->op == RX_SPLIT){
+			d->stack[top++] = in->y;
+			d->stack[top++] = in->x;
+		}
+		else if(in->op == RX_ASSERT && edges & RX_EDGE(in->set)){
+			d->stack[top++] = in->x;
+		}
+		else{
+			d->buf[(*n)++] = i;
+		}
+	}
+}
+
+int regex_int_cmp(const void *a, const void *b){
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Returns the state for the n instructions in d->buf after the line edges
+ * in `edges`, building it if it is new. Sets *flushed when the cache had
+ * to be emptied for it. */
+int regex_dfa_state(struct regex_dfa *d, int n, int edges, bool *flushed){
+	qsort(d->buf, n, sizeof(int), regex_int_cmp);
+	unsigned h = 2166136261u ^ edges;
+	for(int i = 0; i < n; i++) h = (h ^ d->buf[i]) * 16777619u;
+	unsigned mask = RX_DFA_MAX_STATES * 2 - 1;
+	for(unsigned slot = h & mask; d->hash[slot]; slot = (slot + 1) & mask){
+		int s = d->hash[slot] - 1;
+		if(d->item_len[s] == n && d->edges[s] == edges && memcmp(d->items + d->item_start[s], d->buf, sizeof(int) * n) == 0) return s;
+	}
+
+	if(d->nstates == RX_DFA_MAX_STATES){
+		memset(d->hash, 0, sizeof(int) * RX_DFA_MAX_STATES * 2);
+		d->nstates = 0;
+		d->nitems = 0;
+		d->start = -1;
+		*flushed = true;
+	}
+	int nc = d->re->nclasses;
+	if(d->nstates == d->states_cap){
+		d->states_cap = d->states_cap ? d->states_cap * 2 : 16;
+		d->trans = xrealloc(d->trans, sizeof(int) * nc * d->states_cap);
+		d->accept = xrealloc(d->accept, sizeof(bool) * d->states_cap);
+		d->edges = xrealloc(d->edges, d->states_cap);
+		d->item_start = xrealloc(d->item_start, sizeof(long) * d->states_cap);
+		d->item_len = xrealloc(d->item_len, sizeof(int) * d->states_cap);
+		if(d->trans == NULL || d->accept == NULL || d->edges == NULL || d->item_start == NULL || d->item_len == NULL) die("realloc");
+	}
+	if(d->nitems + n > d->items_cap){
+		while(d->nitems + n > d->items_cap) d->items_cap = d->items_cap ? d->items_cap * 2 : 256;
+		d->items = xrealloc(d->items, sizeof(int) * d->items_cap);
+		if(d->items == NULL) die("realloc");
+	}
+
+	int s = d->nstates++;
+	memcpy(d->items + d->nitems, d->buf, sizeof(int) * n);
+	d->item_start[s] = d->nitems;
+	d->item_len[s] = n;
+	d->nitems += n;
+	d->edges[s] = edges;
+	d->accept[s] = false;
+	for(int i = 0; i < n; i++) d->accept[s] |= d->prog->inst[d->buf[i]].op == RX_MATCH;
+	for(int c = 0; c < nc; c++) d->trans[s * nc + c] = -1;
+	unsigned slot = h & mask;
+	while(d->hash[slot]) slot = (slot + 1) & mask;
+	d->hash[slot] = s + 1;
+	return s;
+}
+
+int regex_dfa_start(struct regex_dfa *d){
+	if(d->start < 0){
+		int n = 0;
+		bool flushed = false;
+		d->stamp++;
+		regex_dfa_closure(d, d->prog->start, 0, &n);
+		d->start = regex_dfa_state(d, n, 0, &flushed);
+	}
+	return d->start;
+}
+
+/* The state after state reads sym, when it hasn't been built yet. A byte
+ * moves the instructions that take it on; a BOL or EOL moves nothing and
+ * only lets the assertions waiting for it, or for one read just before,
+ * through. */
+int regex_dfa_build(struct regex_dfa *d, int state, int sym){
+	int c = d->re->classes[sym];
+	int next, n = 0;
+	int edges = ( sym >= RX_BOL ? d->edges[state] | RX_EDGE(sym) : 0 );
+	bool flushed = false;
+	d->stamp++;
+	const int *items = d->items + d->item_start[state];
+	for(int i = 0; i < d->item_len[state]; i++){
+		const struct regex_inst *in = d->prog->inst + items[i];
+		if(edges) regex_dfa_closure(d, items[i], edges, &n);
+		else if(in->op == RX_SET && regex_set_has(d->re->sets[in->set], sym)) regex_dfa_closure(d, in->x, 0, &n);
+	}
+	if(d->unanchored) regex_dfa_closure(d, d->prog->start, edges, &n);
+	next = regex_dfa_state(d, n, edges, &flushed);
+	if(!flushed) d->trans[state * d->re->nclasses + c] = next;
+	return next;
+}
+
+/* The state after state reads sym. */
+static inline int regex_dfa_step(struct regex_dfa *d, int state, int sym){
+	int next = d->trans[state * d->re->nclasses + d->re->classes[sym]];
+	return ( next >= 0 ? next : regex_dfa_build(d, state, sym) );
+}
+
+void regex_matcher_init(struct regex_matcher *m, const struct regex *re){
+	memset(m, 0, sizeof(*m));
+	m->re = re;
+	regex_dfa_init(&m->fwd, re, 0, false);
+	regex_dfa_init(&m->rev, re, 1, true);
+}
+
+void regex_matcher_free(struct regex_matcher *m){
+	regex_dfa_free(&m->fwd);
+	regex_dfa_free(&m->rev);
+	xfree(m->starts);
+}
+
+/* Symbol v of a line read as BOL, text, EOL. */
+static inline int regex_symbol(const char *text, long len, long v){
+	return v == 0 ? RX_BOL : v == len + 1 ? RX_EOL : (unsigned char)text[v - 1];
+}
+
+/* Returns the position the longest match from position v ends at. */
+long regex_longest(struct regex_matcher *m, const char *text, long len, long v){
+	int st = regex_dfa_start(&m->fwd);
+	long last = v;
+	for(long i = v; i <= len + 1; i++){
+		st = regex_dfa_step(&m->fwd, st, regex_symbol(text, len, i));
+		if(m->fwd.item_len[st] == 0) break;
+		if(m->fwd.accept[st]) last = i + 1;
+	}
+	return last;
+}
+
+/* Returns where the leftmost-longest match at or after `from` starts, or
+ * -1, and sets *end to where it ends. A search from 0 always rescans the
+ * line; later ones reuse what that scan found. */
+long regex_find(struct regex_matcher *m, const char *text, long len, long from, long *end){
+	if(from == 0 || m->text != text || m->len != len){
+		if(len + 2 > m->starts_cap){
+			m->starts_cap = len + 2;
+			xfree(m->starts);
+			m->starts = xmalloc(m->starts_cap);
+			if(m->starts == NULL) die("malloc");
+		}
+		struct regex_dfa *d = &m->rev;
+		int st = regex_dfa_step(d, regex_dfa_start(d), RX_EOL);
+		m->starts[len + 1] = d->accept[st];
+		for(long v = len; v > 0; v--){
+			st = regex_dfa_step(d, st, (unsigned char)text[v - 1]);
+			m->starts[v] = d->accept[st];
+		}
+		st = regex_dfa_step(d, st, RX_BOL);
+		m->starts[0] = d->accept[st];
+		m->text = text;
+		m->len = len;
+	}
+
+	// position v is before symbol v, so text[i] is at i + 1 and BOL is at 0
+	long v = ( from == 0 ? 0 : from + 1 );
+	while(v <= len + 1 && !m->starts[v]) v++;
+	if(v > len + 1) return -1;
+
+	// BOL consumes nothing, so a match from 0 takes in every one from 1
+	long last = regex_longest(m, text, len, v);
+	*end = ( last == 0 ? 0 : last - 1 > len ? len : last - 1 );
+	return ( v == 0 ? 0 : v - 1 );
+}
+
+/* --- search --- */
+
+/* Finds a literal needle in text of a given length, nul or not. Short
+ * needles are looked for eight positions at a time: a word of text is
+ * compared against the needle's first byte and the word n - 1 bytes on
+ * against its last one, and only positions where both agree are compared
+ * in full. Needles of SEARCH_HORSPOOL_MIN bytes or more skip ahead with
+ * Boyer-Moore-Horspool instead, and single bytes go to memchr(). */
+
+#define SEARCH_HORSPOOL_MIN 16
+
+void search_compile(struct search_pattern *p, const char *needle, long len, bool regex){
+	regex_free(p->re);
+	p->re = NULL;
+	p->error = NULL;
+	if(regex && len > 0) p->re = regex_compile(needle, len, &p->error);
+	xfree(p->needle);
+	p->needle = xmalloc(len + 1);
+	if(p->needle == NULL) die("malloc");
+	memcpy(p->needle, needle, len);
+	p->needle[len] = '\0';
+	p->len = len;
+	p->horspool = len >= SEARCH_HORSPOOL_MIN;
+	if(!p->horspool) return;
+
+	for(int c = 0; c < 256; c++) p->shift[c] = len;
+	for(long i = 0; i < len - 1; i++) p->shift[(unsigned char)needle[i]] = len - 1 - i;
+}
+
+long search_literal(const struct search_pattern *p, const char *text, long len, long from){
+	long n = p->len, end = len - n;    // end is the last place a match can start
+	const char *needle = p->needle;
+	if(n == 0 || from < 0 || from > end) return -1;
+	if(n == 1){
+		const char *at = memchr(text + from, needle[0], len - from);
+		return at ? at - text : -1;
+	}
+
+	if(p->horspool){
+		unsigned char last = needle[n - 1];
+		for(long i = from; i <= end; i += p->shift[(unsigned char)text[i + n - 1]])
+			if((unsigned char)text[i + n - 1] == last && memcmp(text + i, needle, n - 1) == 0)
+				return i;
+		return -1;
+	}
+
+	long i = from;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const uint64_t ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+	uint64_t first = ones * (unsigned char)needle[0], last = ones * (unsigned char)needle[n - 1];
+	for(; i + 8 <= end + 1; i += 8){
+		uint64_t a, b;
+		memcpy(&a, text + i, 8);
+		memcpy(&b, text + i + n - 1, 8);
+		uint64_t x = (a ^ first) | (b ^ last);     // zero bytes where both ends agree
+		uint64_t hits = (x - ones) & ~x & highs;   // the lowest flag is always a real zero
+		for(; hits; hits &= hits - 1){
+			long at = i + __builtin_ctzll(hits) / 8;
+			if(memcmp(text + at, needle, n) == 0) return at;
+		}
+	}
+#endif
+	for(; i <= end; i++)
+		if(text[i] == needle[0] && text[i + n - 1] == needle[n - 1] && memcmp(text + i, needle, n) == 0)
+			return i;
+	return -1;
+}
+
+/* Returns where the first match at or after `from` starts, or -1, and
+ * sets *end to where it ends. Regex patterns run on m, which must be kept
+ * to one thread. */
+long search_next(const struct search_pattern *p, struct regex_matcher *m, const char *text, long len, long from, long *end){
+	if(p->error || from < 0 || from > len) return -1;
+	if(p->re) return regex_find(m, text, len, from, end);
+	long at = search_literal(p, text, len, from);
+	*end = at + p->len;
+	return at;
+}
+
+/* Where to look for the match after one at [at, end). Literal matches may
+ * overlap; regex matches don't, and an empty one steps a byte. */
+long search_after(const struct search_pattern *p, long at, long end){
+	return ( p->re && end > at ? end : at + 1 );
+}
+
+/* Returns where the last match starting before `before` starts, or -1. */
+long search_prev(const struct search_pattern *p, struct regex_matcher *m, const char *text, long len, long before){
+	long at = -1, end;
+	for(long i = search_next(p, m, text, len, 0, &end); i >= 0 && i < before; i = search_next(p, m, text, len, search_after(p, i, end), &end))
+		at = i;
+	return at;
+}
+
+char *search_line_text(long line, long *len){
+	struct row_iter it;
+	row_iter_seek(&it, line);
+	return row_iter_text(&it, len);
+}
+
+/* Whole-file searches are split into jobs of about SEARCH_JOB_BYTES,
+ * searched by up to SEARCH_MAX_THREADS workers while the prompt stays
+ * live. Each finished job wakes the UI, which merges the jobs done so far
+ * in row order into the match index and moves to a match once the index
+ * reaches it. Moving between matches is a binary search of the index.
+ * The rows can't change while the prompt is up, and the workers are
+ * stopped before it goes away. */
+
+#define SEARCH_JOB_BYTES (1 << 20)
+#define SEARCH_JOB_LINES 16384
+#define SEARCH_MAX_MATCHES (1 << 22)
+
+long map_offset(long line){
+	return line < St.map.lines ? (long)St.map.line_start[line] : (long)St.map.size;
+}
+
+void search_add_job(long seg, long first, long lines){
+	struct search *s = &St.search;
+	if(s->njobs == s->jobs_cap){
+		s->jobs_cap = s->jobs_cap ? s->jobs_cap * 2 : 64;
+		s->jobs = xrealloc(s->jobs, sizeof(struct search_job) * s->jobs_cap);
+		if(s->jobs == NULL) die("realloc");
+	}
+	struct search_job *job = s->jobs + s->njobs++;
+	job->seg = seg;
+	job->first = first;
+	job->lines = lines;
+	job->matches = NULL;
+	job->n = job->cap = job->count = 0;
+	job->done = false;
+}
+
+/* Copies out where every row's text is and cuts the rows into jobs. Runs
+ * of erows are grouped until they hold SEARCH_JOB_BYTES; mapped runs are
+ * cut at the line nearest each SEARCH_JOB_BYTES of the file. */
+void search_plan(){
+	struct search *s = &St.search;
+	editor_gap_close();
+
+	s->nsegs = s->njobs = 0;
+	long cap = 0;
+	struct row_iter it;
+	for(bool more = row_iter_seek(&it, 0); more; more = row_iter_seek(&it, it.at + it.piece->lines - it.offset)){
+		if(s->nsegs == cap){
+			cap = cap ? cap * 2 : 64;
+			s->segs = xrealloc(s->segs, sizeof(struct search_segment) * cap);
+			if(s->segs == NULL) die("realloc");
+		}
+		struct search_segment *seg = s->segs + s->nsegs++;
+		seg->first = it.at;
+		seg->lines = it.piece->lines;
+		seg->rows = it.piece->rows;
+		seg->file_line = it.piece->file_line;
+	}
+
+	long job_first = -1, job_seg = 0, bytes = 0;
+	for(long g = 0; g < s->nsegs; g++){
+		struct search_segment *seg = s->segs + g;
+		if(seg->rows){
+			if(job_first < 0){
+				job_first = seg->first;
+				job_seg = g;
+			}
+			for(long x = 0; x < seg->lines; x++) bytes += seg->rows[x].size + 1;
+			if(bytes >= SEARCH_JOB_BYTES || seg->first + seg->lines - job_first >= SEARCH_JOB_LINES){
+				search_add_job(job_seg, job_first, seg->first + seg->lines - job_first);
+				job_first = -1;
+				bytes = 0;
+			}
+			continue;
+		}
+
+		if(job_first >= 0){
+			search_add_job(job_seg, job_first, seg->first - job_first);
+			job_first = -1;
+			bytes = 0;
+		}
+		long line = seg->file_line, end = seg->file_line + seg->lines;
+		while(line < end){
+			long target = map_offset(line) + SEARCH_JOB_BYTES;
+			long lo = line + 1, hi = end;
+			while(lo < hi){
+				long mid = (lo + hi) / 2;
+				if(map_offset(mid) >= target) hi = mid;
+				else lo = mid + 1;
+			}
+			if(lo - line > SEARCH_JOB_LINES) lo = line + SEARCH_JOB_LINES;
+			search_add_job(g, seg->first + line - seg->file_line, lo - line);
+			line = lo;
+		}
+	}
+	if(job_first >= 0) search_add_job(job_seg, job_first, St.num_rows - job_first);
+}
+
+void search_run_job(struct search_job *job, bool store, struct regex_matcher *m){
+	struct search *s = &St.search;
+	long g = job->seg;
+	for(long row = job->first; row < job->first + job->lines; row++){
+		while(row >= s->segs[g].first + s->segs[g].lines) g++;
+		struct search_segment *seg = s->segs + g;
+		long len;
+		const char *text;
+		if(seg->rows){
+			text = seg->rows[row - seg->first].characters;
+			len = seg->rows[row - seg->first].size;
+		}
+		else{
+			text = map_line(seg->file_line + row - seg->first, &len);
+		}
+
+		long end;
+		for(long at = search_next(&s->pattern, m, text, len, 0, &end); at >= 0; at = search_next(&s->pattern, m, text, len, search_after(&s->pattern, at, end), &end)){
+			job->count++;
+			if(!store) continue;
+			if(job->n == job->cap){
+				job->cap = job->cap ? job->cap * 2 : 64;
+				job->matches = xrealloc(job->matches, sizeof(struct search_match) * job->cap);
+				if(job->matches == NULL) die("realloc");
+			}
+			job->matches[job->n].line = row;
+			job->matches[job->n].at = at;
+			job->n++;
+		}
+	}
+}
+
+void *search_worker(void *arg){
+	(void)arg;
+	struct search *s = &St.search;
+	struct regex_matcher m;    // DFA states are built per thread
+	if(s->pattern.re) regex_matcher_init(&m, s->pattern.re);
+	while(1){
+		pthread_mutex_lock(&s->lock);
+		long j = ( s->cancel || s->next_job == s->njobs ? -1 : s->next_job++ );
+		bool store = s->stored < SEARCH_MAX_MATCHES;
+		pthread_mutex_unlock(&s->lock);
+		if(j < 0) break;
+
+		search_run_job(s->jobs + j, store, &m);
+
+		pthread_mutex_lock(&s->lock);
+		s->jobs[j].done = true;
+		s->total += s->jobs[j].count;
+		s->stored += s->jobs[j].n;
+		pthread_mutex_unlock(&s->lock);
+		editor_wake();
+	}
+	if(s->pattern.re) regex_matcher_free(&m);
+	return NULL;
+}
+
+/* Stops the workers and forgets the jobs. The index is kept. */
+void search_stop(){
+	struct search *s = &St.search;
+	pthread_mutex_lock(&s->lock);
+	s->cancel = true;
+	pthread_mutex_unlock(&s->lock);
+	for(int t = 0; t < s->nthreads; t++) pthread_join(s->threads[t], NULL);
+	s->nthreads = 0;
+
+	for(long j = 0; j < s->njobs; j++) xfree(s->jobs[j].matches);
+	s->njobs = 0;
+	s->merged = 0;
+	s->pending = 0;
+}
+
+/* Drops the pattern and the index of the last search, which point into
+ * rows that may have changed since. */
+void search_forget(){
+	struct search *s = &St.search;
+	s->pattern.len = 0;
+	s->n = s->total = s->stored = 0;
+	s->covered = 0;
+	s->truncated = false;
+	s->line = s->k = -1;
+}
+
+bool search_running(){
+	return St.search.merged < St.search.njobs && !St.search.truncated;
+}
+
+/* Merges the jobs finished so far, in row order, into the index. Matches
+ * past SEARCH_MAX_MATCHES are counted but not indexed, and the index then
+ * stops at the last whole row it holds. */
+void search_merge(){
+	struct search *s = &St.search;
+	while(search_running()){
+		pthread_mutex_lock(&s->lock);
+		bool done = s->jobs[s->merged].done;
+		pthread_mutex_unlock(&s->lock);
+		if(!done) break;
+
+		struct search_job *job = s->jobs + s->merged++;
+		long take = job->n;
+		if(job->n < job->count || s->n + take > SEARCH_MAX_MATCHES){
+			if(s->n + take > SEARCH_MAX_MATCHES) take = SEARCH_MAX_MATCHES - s->n;
+			long line = ( take > 0 ? job->matches[take - 1].line : job->first );
+			while(take > 0 && job->matches[take - 1].line == line) take--;
+			s->covered = line;
+			s->truncated = true;
+		}
+		else{
+			s->covered = job->first + job->lines;
+		}
+
+		if(s->n + take > s->cap){
+			while(s->n + take > s->cap) s->cap = s->cap ? s->cap * 2 : 1024;
+			s->index = xrealloc(s->index, sizeof(struct search_match) * s->cap);
+			if(s->index == NULL) die("realloc");
+		}
+		if(take) memcpy(s->index + s->n, job->matches, sizeof(struct search_match) * take);
+		s->n += take;
+		xfree(job->matches);
+		job->matches = NULL;
+	}
+	if(!search_running()) s->covered = ( s->truncated ? s->covered : St.num_rows );
+}
+
+/* Compiles query into St.search.pattern, with a matcher for it if it is a
+ * regex, without searching for it. */
+void search_use_query(const char *query, long len){
+	struct search *s = &St.search;
+	search_compile(&s->pattern, query, len, s->regex);
+	if(s->matcher){
+		regex_matcher_free(s->matcher);
+		xfree(s->matcher);
+		s->matcher = NULL;
+	}
+	if(s->pattern.re){
+		s->matcher = xmalloc(sizeof(struct regex_matcher));
+		if(s->matcher == NULL) die("malloc");
+		regex_matcher_init(s->matcher, s->pattern.re);
+	}
+}
+
+/* Makes query the pattern and starts looking for it. A literal query that
+ * only adds to the end of the last one can only match where the last one
+ * did, so when that search is complete its index is filtered instead. */
+void search_set_query(const char *query, long len){
+	struct search *s = &St.search;
+	bool refine = !s->regex && s->pattern.re == NULL && !s->pattern.error &&
+		s->pattern.len > 0 && len >= s->pattern.len && !search_running() && !s->truncated &&
+		s->covered == St.num_rows && memcmp(query, s->pattern.needle, s->pattern.len) == 0;
+	search_stop();
+	search_use_query(query, len);
+	s->line = -1;
+	s->k = -1;
+
+	if(refine){
+		long kept = 0;
+		for(long i = 0; i < s->n; i++){
+			long size;
+			char *text = search_line_text(s->index[i].line, &size);
+			if(s->index[i].at + len <= size && memcmp(text + s->index[i].at, query, len) == 0)
+				s->index[kept++] = s->index[i];
+		}
+		s->n = s->total = kept;
+		return;
+	}
+
+	s->n = s->total = s->stored = 0;
+	s->covered = 0;
+	s->truncated = false;
+	s->next_job = 0;
+	s->cancel = false;
+	if(len == 0 || s->pattern.error){
+		s->covered = St.num_rows;
+		return;
+	}
+
+	search_plan();
+	// one job is searched on the spot; more go to workers, at least one
+	// even on a single CPU so the prompt stays live
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads > SEARCH_MAX_THREADS) nthreads = SEARCH_MAX_THREADS;
+	if(nthreads < 1) nthreads = 1;
+	if(s->njobs > 1 && St.wake_pipe[1] >= 0){
+		for(int t = 0; t < nthreads; t++)
+			if(pthread_create(&s->threads[s->nthreads], NULL, search_worker, NULL) == 0) s->nthreads++;
+	}
+	if(s->nthreads == 0) search_worker(NULL);
+	search_merge();
+}
+
+/* Returns the index of the first indexed match after (line, at). */
+long search_index_after(long line, long at){
+	long lo = 0, hi = St.search.n;
+	while(lo < hi){
+		long mid = (lo + hi) / 2;
+		struct search_match *m = St.search.index + mid;
+		if(m->line < line || (m->line == line && m->at <= at)) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+void search_unmark(){
+	struct search *s = &St.search;
+	if(s->hl_line < 0) return;
+	erow *row = editor_row(s->hl_line);
+	if(row && row->gen == St.rc.render_gen){
+		if(s->saved_hl) memcpy(row->hl, s->saved_hl, hl_bytes(row->rsize));
+		else{
+			xfree(row->hl);
+			row->hl = NULL;
+		}
+	}
+	xfree(s->saved_hl);
+	s->saved_hl = NULL;
+	s->hl_line = -1;
+}
+
+/* Puts the cursor on a match and marks it with HL_MATCH. */
+void search_show(long line, long at, long k){
+	struct search *s = &St.search;
+	search_unmark();
+	if(line >= St.num_rows) return;
+	erow *row = editor_row_rendered(line);
+	if(at > row->size) at = row->size;
+	s->line = line;
+	s->at = at;
+	s->k = k;
+
+	St.cx = line;
+	St.cy = at;
+	St.row_offset = (line - St.screen_rows/2);
+	if(St.row_offset < 0) St.row_offset = 0;
+
+	editor_evaluate_ry();
+	s->hl_line = line;
+	if(row->hl){
+		s->saved_hl = xmalloc(hl_bytes(row->rsize));
+		if(s->saved_hl == NULL) die("malloc");
+		memcpy(s->saved_hl, row->hl, hl_bytes(row->rsize));
+	}
+	else{
+		row->hl = xcalloc(hl_bytes(row->rsize), 1);
+		if(row->hl == NULL) die("calloc");
+	}
+	long size, end;
+	const char *text = search_line_text(line, &size);
+	if(s->matcher) s->matcher->text = NULL;    // the row may have been rescanned under another
+	if(search_next(&s->pattern, s->matcher, text, size, at, &end) != at) end = at;
+	hl_fill(row->hl, St.ry, HL_MATCH, editor_row_cx_to_rx(row, end) - St.ry);
+}
+
+/* Looks for the next match row by row past the end of a truncated index. */
+void search_scan(int direction){
+	struct search *s = &St.search;
+	struct row_iter it;
+	long line = ( s->line >= 0 ? s->line : 0 ), len;
+	row_iter_seek(&it, line);
+	for(long i = 0; i <= St.num_rows; i++){
+		char *text = row_iter_text(&it, &len);
+		long at;
+		long end;
+		if(direction == 1) at = search_next(&s->pattern, s->matcher, text, len, ( i == 0 && s->line >= 0 ? s->at + 1 : 0 ), &end);
+		else at = search_prev(&s->pattern, s->matcher, text, len, ( i == 0 && s->line >= 0 ? s->at : len + 1 ));
+		if(at >= 0){
+			long k = search_index_after(it.at, at - 1);
+			bool indexed = k < s->n && s->index[k].line == it.at && s->index[k].at == at;
+			search_show(it.at, at, indexed ? k : -1);
+			return;
+		}
+		if(!row_iter_step(&it, direction))
+			row_iter_seek(&it, direction == 1 ? 0 : St.num_rows - 1);
+	}
+}
+
+/* Moves to the next or previous match. When the index doesn't reach that
+ * far yet the move is left pending until search_poll() merges more. */
+void search_move(int direction){
+	struct search *s = &St.search;
+	s->pending = 0;
+	if(s->pattern.len == 0) return;
+	long i;
+	if(direction == 1){
+		i = search_index_after(s->line, s->at);
+		if(i == s->n && s->covered == St.num_rows) i = 0;
+	}
+	else{
+		i = ( s->line >= 0 ? search_index_after(s->line, s->at - 1) - 1 : -1 );
+		if(i < 0 && s->covered == St.num_rows) i = s->n - 1;
+	}
+
+	if(i >= 0 && i < s->n){
+		search_show(s->index[i].line, s->index[i].at, i);
+	}
+	else if(search_running()){
+		s->pending = direction;
+	}
+	else if(s->truncated && s->total > 0){
+		search_scan(direction);
+	}
+}
+
+/* Called when a worker finishes a job. */
+void search_poll(){
+	struct search *s = &St.search;
+	if(s->njobs == 0) return;
+	search_merge();
+	if(s->pending) search_move(s->pending);
+}
+
+/* Fills buf with "match k of N" for the status bar, N growing while the
+ * search runs. */
+void search_describe(char *buf, long size){
+	struct search *s = &St.search;
+	pthread_mutex_lock(&s->lock);
+	long total = s->total;
+	pthread_mutex_unlock(&s->lock);
+	const char *more = ( search_running() ? "+" : "" );
+
+	const char *mode = ( s->regex ? "regex: " : "" );
+	if(s->pattern.error) snprintf(buf, size, "regex: %s", s->pattern.error);
+	else if(s->pattern.len == 0) snprintf(buf, size, "%ssearch", mode);
+	else if(s->line < 0) snprintf(buf, size, "%s%ld%s matches", mode, total, more);
+	else if(s->k < 0) snprintf(buf, size, "%smatch ? of %ld%s", mode, total, more);
+	else snprintf(buf, size, "%smatch %ld of %ld%s", mode, s->k + 1, total, more);
+}
+
+/* editor find */
+
+void editor_find_callback(char* query, int key){
+	search_unmark();
+
+	if( key == '\r' || key == ESC ) return;
+	else if( key == ARROW_RIGHT || key == ARROW_DOWN ) search_move(1);
+	else if( key == ARROW_LEFT || key == ARROW_UP ) search_move(-1);
+	else {
+		if( key == CTRL_KEY('r') ) St.search.regex = !St.search.regex;
+		search_set_query(query, strlen(query));
+		search_move(1);
+	}
+}
+
+/* Runs the search prompt and returns the query, or NULL with the cursor
+ * put back if it was cancelled. St.search.pattern is left compiled. */
+char *editor_find_prompt(const char *prompt){
+
+	long cx_orig = St.cx;
+	long cy_orig = St.cy;
+	long row_offset_orig = St.row_offset;
+	long col_offset_orig = St.col_offset;
+
+	// the rows may have changed since the last search
+	search_stop();
+	search_forget();
+	St.search.active = true;
+	char *query = editor_prompt(prompt, editor_find_callback, false);
+	St.search.active = false;
+	search_stop();
+
+	if(query == NULL){
+		St.cx = cx_orig;
+		St.cy = cy_orig;
+		St.row_offset = row_offset_orig;
+		St.col_offset = col_offset_orig;
+	}
+	return query;
+}
+
+void editor_find(){
+	xfree(editor_find_prompt("SEARCH : %s (Use Esc/Enter/ArrowKeys, Ctrl-R regex)"));
+}
+
+/* --- replace --- */
+
+/* Replacing finds every match first and then rewrites each row that has
+ * any in one pass into a fresh block of text. Rewritten rows are only
+ * marked stale, so rows off screen are rendered once when they are next
+ * needed. The ones that had been rendered are rendered again once the
+ * batch is done, in row order, so comment state changes are carried down
+ * once instead of per edit. */
+
+struct replace_match{
+	long line, at, end;
+};
+
+/* Returns every match of St.search.pattern in *matches, in row order and
+ * none overlapping. */
+long replace_collect(struct replace_match **matches){
+	struct search *s = &St.search;
+	struct row_iter it;
+	long n = 0, cap = 0;
+	*matches = NULL;
+	editor_gap_close();
+	for(bool more = row_iter_seek(&it, 0); more; more = row_iter_step(&it, 1)){
+		long len, end, last = -1;
+		const char *text = row_iter_text(&it, &len);
+		for(long at = search_next(&s->pattern, s->matcher, text, len, 0, &end); at >= 0;
+				at = search_next(&s->pattern, s->matcher, text, len, ( end > at ? end : at + 1 ), &end)){
+			if(at == end && at == last) continue;    // nothing empty right after a match
+			if(n == cap){
+				cap = cap ? cap * 2 : 256;
+				*matches = xrealloc(*matches, sizeof(struct replace_match) * cap);
+				if(*matches == NULL) die("realloc");
+			}
+			(*matches)[n++] = (struct replace_match){ it.at, at, end };
+			last = end;
+		}
+	}
+	return n;
+}
+
+/* Replaces the n matches with `with`. Returns how many rows changed. */
+long replace_rows(const struct replace_match *m, long n, const char *with, long len){
+	long *redo = NULL, nredo = 0, rows = 0;
+	editor_gap_close();
+	for(long i = 0, j; i < n; i = j){
+		long line = m[i].line;
+		erow *row = editor_row(line);
+		long size = row->size;
+		for(j = i; j < n && m[j].line == line; j++) size += len - (m[j].end - m[j].at);
+
+		char *text = text_alloc(size + 1), *to = text;
+		long from = 0;
+		for(long k = i; k < j; k++){
+			memcpy(to, row->characters + from, m[k].at - from);
+			to += m[k].at - from;
+			memcpy(to, with, len);
+			to += len;
+			from = m[k].end;
+		}
+		memcpy(to, row->characters + from, row->size - from);
+		text[size] = '\0';
+
+		if(row->gen == St.rc.render_gen){
+			if(nredo % 256 == 0){
+				redo = xrealloc(redo, sizeof(long) * (nredo + 256));
+				if(redo == NULL) die("realloc");
+			}
+			redo[nredo++] = line;
+		}
+		editor_row_set_text(line, text, size);
+		rows++;
+	}
+
+	for(long i = 0; i < nredo; i++) editor_row_rendered(redo[i]);
+	xfree(redo);
+	return rows;
+}
+
+/* Asks about each match in turn and drops the ones turned down from m.
+ * Returns how many are left, or -1 if the user gave up. */
+long replace_confirm(struct replace_match *m, long n){
+	long kept = 0;
+	bool all = false;
+	for(long i = 0; i < n; i++){
+		if(all){
+			m[kept++] = m[i];
+			continue;
+		}
+		search_show(m[i].line, m[i].at, -1);
+		editor_set_status_message("Replace %ld of %ld? (y/n, a = all the rest, Esc = cancel)", i + 1, n);
+		editor_timer_cancel(TIMER_STATUS_MESSAGE);
+		editor_refresh_screen();
+		int key = editor_read_key();
+		search_unmark();
+		if(key == ESC || key == CTRL_KEY('q')) return -1;
+		if(key == 'a') all = true;
+		if(key == 'y' || key == 'a') m[kept++] = m[i];
+		else if(key != 'n') i--;
+	}
+	return kept;
+}
+
+void editor_replace(){
+	long cx_orig = St.cx, cy_orig = St.cy;
+	long row_offset_orig = St.row_offset, col_offset_orig = St.col_offset;
+	char *query = editor_find_prompt("REPLACE : %s (Use Esc/Enter/ArrowKeys, Ctrl-R regex)");
+	if(query == NULL) return;
+	xfree(query);
+	if(St.search.pattern.error){
+		editor_set_status_message("Bad regex: %s", St.search.pattern.error);
+		return;
+	}
+
+	char *with = editor_prompt("REPLACE WITH : %s (Esc to cancel)", NULL, true);
+	if(with == NULL) return;
+	editor_set_status_message("Replace [a]ll or [i]nteractively? (Esc to cancel)");
+	editor_refresh_screen();
+	int mode = editor_read_key();
+
+	long long start = monotonic_ms();
+	struct replace_match *m;
+	long n = ( mode == 'a' || mode == 'i' ? replace_collect(&m) : 0 );
+	if(mode == 'i' && n > 0){
+		long long asked = monotonic_ms();
+		n = replace_confirm(m, n);
+		start += monotonic_ms() - asked;    // the time spent asking doesn't count
+	}
+	long rows = ( n > 0 ? replace_rows(m, n, with, strlen(with)) : 0 );
+	long long elapsed = monotonic_ms() - start;
+	if(mode == 'a' || mode == 'i') xfree(m);
+	xfree(with);
+
+	St.cx = cx_orig;
+	St.cy = cy_orig;
+	St.row_offset = row_offset_orig;
+	St.col_offset = col_offset_orig;
+	if(St.cx < St.num_rows && St.cy > editor_row(St.cx)->size) St.cy = editor_row(St.cx)->size;
+
+	if(mode != 'a' && mode != 'i') editor_set_status_message("Replace cancelled");
+	else if(n < 0) editor_set_status_message("Replace cancelled, nothing changed");
+	else editor_set_status_message("Replaced %ld matches in %ld rows in %lld ms", n, rows, elapsed);
+}
+
+/* --- appendable string --- */ 
+
+void append(struct appendable_str *to, const char *str, long len){
+	if(len <= 0) return;
+	if(to->len + len > to->cap){
+		long cap = to->cap ? to->cap * 2 : 4096;
+		while(cap < to->len + len) cap *= 2;
+		char *buf = xrealloc(to->buf, cap);
+		if(buf == NULL) return;
+		to->buf = buf;
+		to->cap = cap;
+	}
+
+	memcpy(to->buf + to->len, str, len);
+	to->len += len;
+}
+
+/* Writes all of buf, carrying on after short writes and interrupts. */
+int write_all(int fd, const char *buf, long len){
+	while(len > 0){
+		ssize_t n = write(fd, buf, len);
+		if(n == -1){
+			if(errno == EINTR || errno == EAGAIN) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Reads one byte from the terminal, giving up after timeout_ms. */
+bool terminal_read_byte(char *ch, int timeout_ms){
+	struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+	if(poll(&fd, 1, timeout_ms) <= 0) return false;
+	return read(STDIN_FILENO, ch, 1) == 1;
+}
+
+int get_cursor_position(long *X, long *Y){
+	if( write(STDOUT_FILENO, "\x1b[6n", 4) != 4 ) return -1;
+
+	char buf[32];
+	char ch;
+
+	unsigned i = 0;
+	while (terminal_read_byte(&ch, TERMINAL_REPLY_TIMEOUT_MS) && ch != 'R') {
+		buf[i] = ch;
+		i++;
+	}
+
+	buf[i] = '\0';
+
+	if(buf[0] != '\x1b' || buf[1] != '[') return -1;
+	if(sscanf(buf + 2, "%ld;%ld", X, Y) != 2) return -1;
+
+	return 0;
+}
+
+int get_window_size(long *X, long *Y){
+	struct winsize ws;
 	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0){
 		if( ! MOVE_CURSOR_TO_BOTTOM_RIGHT() ) return -1;
 		return get_cursor_position(X, Y);
@@ -537,26 +4298,403 @@ int get_window_size(long *X, long *Y){
 }
 
 
+/* Queues bytes read while waiting for a terminal reply as input, so keys
+ * typed then aren't lost. */
+void terminal_queue_input(const char *s, long len){
+	struct input_queue *in = &St.input;
+	if(in->start + in->len + len > (long)sizeof(in->buf)) return;
+	memcpy(in->buf + in->start + in->len, s, len);
+	in->len += len;
+}
+
+/* Asks for mode 2026 and then for the device attributes, which every
+ * terminal answers, so a terminal that doesn't know the mode still ends
+ * the wait. Replies are ESC [ ? ... followed by a final byte; anything
+ * else read meanwhile was typed and is queued. A reply that only arrives
+ * after the wait is dropped by editor_read_key(). */
+bool terminal_supports_synchronized_output(){
+	const char *query = "\x1b[?2026$p\x1b[c";
+	if(write(STDOUT_FILENO, query, strlen(query)) != (ssize_t)strlen(query)) return false;
+
+	bool supported = false;
+	char buf[64];
+	long n = 0;    // bytes of the reply being read
+	char ch;
+	while(terminal_read_byte(&ch, TERMINAL_REPLY_TIMEOUT_MS)){
+		if(n == 0 && ch != ESC){
+			terminal_queue_input(&ch, 1);
+			continue;
+		}
+		buf[n++] = ch;
+		if((n == 2 && ch != '[') || (n == 3 && ch != '?') || n == (long)sizeof(buf) - 1){
+			terminal_queue_input(buf, n);
+			n = 0;
+			continue;
+		}
+		if(n < 4 || ch < '@' || ch > '~') continue;
+
+		// ESC [ ? 2026 ; Ps $ y, where Ps 1 or 2 means supported
+		buf[n] = '\0';
+		if(ch == 'y' && strncmp(buf, "\x1b[?2026;", 8) == 0 && (buf[8] == '1' || buf[8] == '2'))
+			supported = true;
+		n = 0;
+		if(ch == 'c') break;
+	}
+	return supported;
+}
+
 /* --- init --- */
 
-void init_editor(){
+/* Sets up everything that doesn't need the terminal. */
+void init_editor_state(){
 	St.num_rows = 0;
 	St.cx = St.cy = St.ry = 0;
 	St.row_offset = St.col_offset = 0;
 	St.rows = NULL;
+	St.gap.row = NULL;
+	St.map.data = NULL;
+	St.map.size = 0;
+	St.map.lines = 0;
+	St.map.line_start = NULL;
+	St.map.comment_state = NULL;
+	St.map.detached = false;
 	St.file_name = NULL;
 	St.status_msg[0] = '\0';
-	St.status_msg_time = 0;
+	St.input.start = St.input.len = 0;
+	for(int t = 0; t < TIMER_COUNT; t++) St.timers[t] = 0;
 	St.modified = 0;
 	St.quit_pressed_last = false;
-	St.syntax = NULL;
+	St.rc.syntax = NULL;
+	St.rc.render_gen = 1;
+	St.rc.render_tmp.buf = NULL;
+	St.rc.render_tmp.len = St.rc.render_tmp.cap = 0;
+	St.rc.lex_resume.row = NULL;
+	St.hl_dirty_from = LONG_MAX;
+	St.hl_dirty_to = -1;
+	memset(&St.text, 0, sizeof(St.text));
+	St.wake_pipe[0] = St.wake_pipe[1] = -1;
+	memset(&St.search, 0, sizeof(St.search));
+	St.search.line = St.search.hl_line = -1;
+	pthread_mutex_init(&St.search.lock, NULL);
+	memset(&St.journal, 0, sizeof(St.journal));
+	St.journal.fd = -1;
+	pthread_mutex_init(&St.journal.lock, NULL);
+	pthread_cond_init(&St.journal.wake, NULL);
+	pthread_cond_init(&St.journal.idle, NULL);
+	memset(&St.undo, 0, sizeof(St.undo));
+	const char *budget = getenv("SEDIT_UNDO_BUDGET_MB");
+	St.undo.budget = ( budget ? atol(budget) : SEDIT_UNDO_BUDGET_MB ) << 20;
+}
+
+void init_editor(){
+	init_editor_state();
 
 	if(get_window_size(&St.screen_rows, &St.screen_cols) == -1)
 		die("get_window_size");
 
 	St.screen_rows -= 2;    //Leaving last 2 lines for status bar and message.
+
+	editor_init_events();
+	St.synchronized_output = terminal_supports_synchronized_output();
+	screen_init_sgr();
+}
+
+
+/* --- screen --- */
+
+/* A frame is drawn into a back buffer of cells, each a byte plus the
+ * attribute it is shown with, and compared line by line with the front
+ * buffer, which holds what the terminal currently shows. Only the changed
+ * span of each line is sent. A vertical scroll by less than a screen is
+ * handed to the terminal as a scroll of the text area, so only the rows
+ * it exposes are drawn. The whole screen is redrawn after a resize or a
+ * horizontal scroll. */
+
+void screen_line_reserve(struct screen_line *l, long len){
+	if(len <= l->cap) return;
+	long cap = l->cap ? l->cap : 128;
+	while(cap < len) cap *= 2;
+	l->chars = xrealloc(l->chars, cap);
+	l->attrs = xrealloc(l->attrs, cap);
+	if(l->chars == NULL || l->attrs == NULL) die("realloc");
+	l->cap = cap;
+}
+
+void screen_line_put(struct screen_line *l, const char *s, long len, unsigned char attr){
+	if(len <= 0) return;
+	screen_line_reserve(l, l->len + len);
+	memcpy(l->chars + l->len, s, len);
+	memset(l->attrs + l->len, attr, len);
+	l->len += len;
+}
+
+/* Puts cells [from, from + len) of a rendered row, unpacking their
+ * attributes from its hl. */
+void screen_line_put_row(struct screen_line *l, const erow *row, long from, long len){
+	if(len <= 0) return;
+	screen_line_reserve(l, l->len + len);
+	memcpy(l->chars + l->len, row->render + from, len);
+	unsigned char *attrs = l->attrs + l->len;
+	if(row->hl == NULL) memset(attrs, HL_NORMAL, len);
+	else for(long y = 0; y < len; y++) attrs[y] = hl_get(row->hl, from + y);
+	l->len += len;
+}
+
+bool screen_line_is_ascii(struct screen_line *l){
+	for(long y = 0; y < l->len; y++)
+		if((unsigned char)l->chars[y] >= 128) return false;
+	return true;
+}
+
+void screen_frame_resize(struct screen_frame *f, long rows, long cols){
+	for(long x = rows; x < f->rows; x++){
+		xfree(f->lines[x].chars);
+		xfree(f->lines[x].attrs);
+	}
+	f->lines = xrealloc(f->lines, sizeof(struct screen_line) * rows);
+	if(rows && f->lines == NULL) die("realloc");
+	for(long x = f->rows; x < rows; x++){
+		f->lines[x].chars = NULL;
+		f->lines[x].attrs = NULL;
+		f->lines[x].len = f->lines[x].cap = 0;
+	}
+	f->rows = rows;
+	f->cols = cols;
+	f->valid = false;
+}
+
+/* Sets up the back buffer for a new frame, dropping what the front
+ * buffer knows about the terminal when the frame no longer lines up with
+ * it. */
+void screen_begin_frame(){
+	long rows = St.screen_rows + 2;
+	if(St.front.rows != rows || St.front.cols != St.screen_cols){
+		screen_frame_resize(&St.front, rows, St.screen_cols);
+		screen_frame_resize(&St.back, rows, St.screen_cols);
+	}
+	for(long x = 0; x < rows; x++) St.back.lines[x].len = 0;
+	St.back.row_offset = St.row_offset;
+	St.back.col_offset = St.col_offset;
+	St.back.valid = true;
+}
+
+/* Fills in the SGR sequence that switches to each cell attribute, so
+ * spans don't have to format them as they go. */
+void screen_init_sgr(){
+	for(int hl = HL_NORMAL; hl <= HL_KEYWORD_2; hl++)
+		screen_sgr[hl].len = snprintf(screen_sgr[hl].seq, sizeof(screen_sgr[hl].seq),
+				CHANGE_COLOR_FORMAT_ESQ, editor_syntax_to_color(hl));
+
+	strcpy(screen_sgr[HL_NORMAL].seq, DEFAULT_CHARACTER_ESQ);
+	screen_sgr[HL_NORMAL].len = strlen(DEFAULT_CHARACTER_ESQ);
+	strcpy(screen_sgr[SCREEN_ATTR_INVERT].seq, INVERT_COLOR_ESQ);
+	screen_sgr[SCREEN_ATTR_INVERT].len = strlen(INVERT_COLOR_ESQ);
+}
+
+void screen_set_attr(struct appendable_str *astr, int from, int to){
+	if(from == to) return;
+	if(from == SCREEN_ATTR_INVERT || to == SCREEN_ATTR_INVERT || to == -1)
+		append(astr, NORMAL_COLOR_ESQ, strlen(NORMAL_COLOR_ESQ));
+	if(to == -1 || (to == HL_NORMAL && from == SCREEN_ATTR_INVERT)) return;
+	append(astr, screen_sgr[to].seq, screen_sgr[to].len);
+}
+
+/* Returns the end of the run of cells in [from, to) that share the
+ * attribute of cell `from`, comparing eight attributes at a time. */
+long screen_attr_run_end(const unsigned char *attrs, long from, long to){
+	uint64_t pattern = attrs[from] * 0x0101010101010101ULL;
+	long y = from + 1;
+	while(y + 8 <= to){
+		uint64_t word;
+		memcpy(&word, attrs + y, 8);
+		if(word != pattern) break;
+		y += 8;
+	}
+	while(y < to && attrs[y] == attrs[from]) y++;
+	return y;
+}
+
+/* Sends the cells [first, last) of screen line x, clearing the rest of
+ * the line first when the old contents may reach further. */
+void screen_emit_span(struct appendable_str *astr, long x, long first, long last, bool clear){
+	struct screen_line *l = St.back.lines + x;
+
+	char move[48];    // room for two longs
+	int mlen = snprintf(move, sizeof(move), MOVE_CURSOR_FORMAT_ESQ, x + 1, first + 1);
+	append(astr, move, mlen);
+	if(clear) append(astr, CLEAR_LINE, strlen(CLEAR_LINE));
+
+	int attr = -1;
+	for(long y = first, end; y < last; y = end){
+		end = screen_attr_run_end(l->attrs, y, last);
+		screen_set_attr(astr, attr, l->attrs[y]);
+		attr = l->attrs[y];
+		append(astr, l->chars + y, end - y);
+	}
+	screen_set_attr(astr, attr, -1);
+}
+
+/* Scrolls the text area of the terminal by `delta` rows (up when
+ * positive) and shifts the front buffer to match. The rows scrolled in
+ * are blank on the terminal, so they are left empty. */
+void screen_scroll(struct appendable_str *astr, long delta){
+	char buf[32];
+	long rows = St.screen_rows;
+	long n = ( delta > 0 ? delta : -delta );
+
+	int len = snprintf(buf, sizeof(buf), SET_SCROLL_REGION_FORMAT_ESQ, rows);
+	append(astr, buf, len);
+	len = snprintf(buf, sizeof(buf), ( delta > 0 ? SCROLL_UP_FORMAT_ESQ : SCROLL_DOWN_FORMAT_ESQ ), n);
+	append(astr, buf, len);
+	append(astr, RESET_SCROLL_REGION_ESQ, strlen(RESET_SCROLL_REGION_ESQ));
+
+	struct screen_line *lines = St.front.lines;
+	struct screen_line *moved = xmalloc(sizeof(struct screen_line) * n);
+	if(moved == NULL) die("malloc");
+	if(delta > 0){
+		memcpy(moved, lines, sizeof(struct screen_line) * n);
+		memmove(lines, lines + n, sizeof(struct screen_line) * (rows - n));
+		memcpy(lines + rows - n, moved, sizeof(struct screen_line) * n);
+		for(long x = rows - n; x < rows; x++) lines[x].len = 0;
+	}
+	else{
+		memcpy(moved, lines + rows - n, sizeof(struct screen_line) * n);
+		memmove(lines + n, lines, sizeof(struct screen_line) * (rows - n));
+		memcpy(lines, moved, sizeof(struct screen_line) * n);
+		for(long x = 0; x < n; x++) lines[x].len = 0;
+	}
+	xfree(moved);
+}
+
+/* Appends the escapes that turn the front buffer into the back buffer,
+ * then swaps them. Returns the number of lines that changed. */
+long screen_flush(struct appendable_str *astr){
+	long changed = 0;
+
+	if(St.front.valid && St.front.col_offset != St.back.col_offset)
+		St.front.valid = false;
+	if(St.front.valid && St.front.row_offset != St.back.row_offset){
+		long delta = St.back.row_offset - St.front.row_offset;
+		if(delta < St.screen_rows && -delta < St.screen_rows){
+			screen_scroll(astr, delta);
+			changed++;
+		}
+		else{
+			St.front.valid = false;
+		}
+	}
+	bool valid = St.front.valid;
+
+	for(long x = 0; x < St.back.rows; x++){
+		struct screen_line *b = St.back.lines + x;
+		struct screen_line *f = St.front.lines + x;
+
+		if(!valid){
+			screen_emit_span(astr, x, 0, b->len, true);
+			changed++;
+			continue;
+		}
+		if(b->len == f->len && (b->len == 0 || (memcmp(b->chars, f->chars, b->len) == 0 && memcmp(b->attrs, f->attrs, b->len) == 0)))
+			continue;
+
+		// column arithmetic only holds when every byte is one column wide
+		long first = 0, last = b->len;
+		bool ascii = screen_line_is_ascii(b) && screen_line_is_ascii(f);
+		if(ascii){
+			long common = ( b->len < f->len ? b->len : f->len );
+			while(first < common && b->chars[first] == f->chars[first] && b->attrs[first] == f->attrs[first])
+				first++;
+			if(b->len == f->len){
+				while(last > first && b->chars[last-1] == f->chars[last-1] && b->attrs[last-1] == f->attrs[last-1])
+					last--;
+			}
+		}
+		screen_emit_span(astr, x, first, last, !ascii || b->len < f->len);
+		changed++;
+	}
+
+	struct screen_frame tmp = St.front;
+	St.front = St.back;
+	St.back = tmp;
+	return changed;
+}
+
+/* --- stats --- */
+
+/* The diagnostics overlay, toggled with Ctrl-D, replaces the status
+ * message with: the time the last frame took to build and the worst since
+ * the overlay came up, the bytes that frame wrote, the rows highlighted
+ * for the last key and how many of those were a comment state cascading
+ * down, the heap and arena calls between the last two frames, and the
+ * resident set. The overlay is drawn as part of a frame, so the frame it
+ * reports on is the one before. */
+
+void stats_toggle(){
+#if SEDIT_STATS
+	St.stats.shown = !St.stats.shown;
+	St.stats.worst_frame_ns = 0;
+#else
+	editor_set_status_message("Diagnostics were compiled out (SEDIT_STATS=0)");
+#endif
+}
+
+/* Called as a key is taken. */
+void stats_key(){
+#if SEDIT_STATS
+	St.stats.last_key_hl = St.stats.key_hl;
+	St.stats.last_key_cascade = St.stats.key_cascade;
+	St.stats.key_hl = St.stats.key_cascade = 0;
+#endif
+}
+
+/* Called as a frame starts; returns the time it started. */
+long long stats_frame_begin(){
+#if SEDIT_STATS
+	struct stats *s = &St.stats;
+	s->frame_allocs = stats_allocs - s->allocs_at_frame;
+	s->frame_arena = s->arena_calls - s->arena_at_frame;
+	s->allocs_at_frame = stats_allocs;
+	s->arena_at_frame = s->arena_calls;
+	return monotonic_ns();
+#else
+	return 0;
+#endif
 }
 
+void stats_frame_end(long long start, long bytes){
+#if SEDIT_STATS
+	struct stats *s = &St.stats;
+	s->frame_ns = monotonic_ns() - start;
+	if(s->frame_ns > s->worst_frame_ns) s->worst_frame_ns = s->frame_ns;
+	s->frame_bytes = bytes;
+#else
+	(void)start;
+	(void)bytes;
+#endif
+}
+
+/* Resident set in KB from /proc, read without going through the heap. */
+long stats_rss_kb(){
+	char buf[64];
+	int fd = open("/proc/self/statm", O_RDONLY);
+	if(fd == -1) return -1;
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if(n <= 0) return -1;
+	buf[n] = '\0';
+	long pages;
+	if(sscanf(buf, "%*s %ld", &pages) != 1) return -1;
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void stats_describe(char *buf, long size){
+	struct stats *s = &St.stats;
+	snprintf(buf, size, "frame %.2f/%.2fms %ldB | hl %ld (%ld cascade) | alloc %ld arena %ld | rss %.1fM",
+			s->frame_ns / 1e6, s->worst_frame_ns / 1e6, s->frame_bytes,
+			s->last_key_hl, s->last_key_cascade,
+			s->frame_allocs, s->frame_arena,
+			stats_rss_kb() / 1024.0);
+}
 
 /* --- output --- */
 
@@ -565,23 +4703,7 @@ void editor_evaluate_ry(){
 		St.ry = 0;
 	}
 	else{
-		erow *row = St.rows + St.cx;
-		long ry = 0;
-		for(long y = 0; y < St.cy; y++){
-			if(row->characters[y] == '\t'){
-				do{
-					ry++;
-				}
-				while(ry % SEDIT_TAB_STOP);
-			}
-			else if(row->characters[y] <= 31){
-				ry += 2;
-			}
-			else{
-				ry++;
-			}
-		}
-		St.ry = ry;
+		St.ry = row_cursor_rx(&St.rc, editor_row_rendered(St.cx), St.cy);
 	}
 }
 
@@ -598,15 +4720,12 @@ void editor_scroll(){
 		St.col_offset = St.ry - St.screen_cols + 1;
 }
 
-long editor_draw_welcome_message_ascii_art(struct appendable_str *astr){
+long editor_draw_welcome_message_ascii_art(){
 	long x;
-	for(x = 0; x < 6; x++){
-		append(astr, CLEAR_LINE, strlen(CLEAR_LINE));
-
-		append(astr, "---", 3);
-		append(astr, name_ascii_art[x], strlen(name_ascii_art[x]));
-
-		append(astr, "\n\r", 2);
+	for(x = 0; x < 6 && x < St.screen_rows; x++){
+		struct screen_line *l = St.back.lines + x;
+		screen_line_put(l, "---", 3, HL_NORMAL);
+		screen_line_put(l, name_ascii_art[x], strlen(name_ascii_art[x]), HL_NORMAL);
 	}
 	return x;
 }
@@ -615,7 +4734,7 @@ bool editor_file_content_fills_whole_screen(){
 	return (St.num_rows - St.row_offset) >= St.screen_rows;
 }
 
-long editor_draw_file_contents(struct appendable_str *astr){
+long editor_draw_file_contents(){
 
 	long X;  // X is index of last row/line of file to be drawn.
 	if(editor_file_content_fills_whole_screen())
@@ -623,52 +4742,26 @@ long editor_draw_file_contents(struct appendable_str *astr){
 	else
 		X = St.num_rows - 1;
 
-	for(long x = St.row_offset; x <= X; x++){
-		append(astr, CLEAR_LINE, strlen(CLEAR_LINE));
+	struct row_iter it;
+	row_iter_seek(&it, St.row_offset);
+	for(long x = St.row_offset; x <= X; x++, row_iter_step(&it, 1)){
+		erow *row = row_iter_row(&it);
+		if(row->gen != St.rc.render_gen) row = editor_row_rendered(x);
 
-		erow *row = St.rows + x;
-		unsigned char *hl = row->hl;
-		char *rseq = row->render;
-		long len = row->rsize;
-		int current_color = -1;
+		long len = row->rsize - St.col_offset;
+		if(len > St.screen_cols) len = St.screen_cols;
 
-		if(len > (long)St.screen_cols) len = St.screen_cols;
-
-		for(long y = St.col_offset; y < len; y++){
-			if(hl[y] == HL_NORMAL){
-				if(current_color != -1){
-					current_color = -1;
-					append(astr, DEFAULT_CHARACTER_ESQ, strlen(DEFAULT_CHARACTER_ESQ));
-				}
-				append(astr, rseq + y, 1);
-			}
-			else{
-				int color = editor_syntax_to_color(hl[y]);
-				if(current_color != color){
-					current_color = color;
-					char buf[16];
-					int clen = snprintf(buf, sizeof(buf), CHANGE_COLOR_FORMAT_ESQ, color);
-					append(astr , buf, clen);
-				}
-				append(astr, rseq + y, 1);
-			}
-		}
-		append(astr, DEFAULT_CHARACTER_ESQ, strlen(DEFAULT_CHARACTER_ESQ));
-		append(astr, "\n\r", 2);
+		screen_line_put_row(St.back.lines + x - St.row_offset, row, St.col_offset, len);
 	}
 	return X + 1;
 }
 
-void editor_draw_empty_rows(struct appendable_str *astr, long first_empty_row){
-	for(long x = first_empty_row - St.row_offset; x < St.screen_rows ; x++){
-		append(astr, CLEAR_LINE, strlen(CLEAR_LINE));
-		append(astr, "---\n\r", 5);
-	}
-}
-
-void editor_draw_status_bar(struct appendable_str *astr){
-	append(astr, INVERT_COLOR_ESQ, strlen(INVERT_COLOR_ESQ));
+void editor_draw_empty_rows(long first_empty_row){
+	for(long x = first_empty_row - St.row_offset; x < St.screen_rows ; x++)
+		screen_line_put(St.back.lines + x, "---", 3, HL_NORMAL);
+}
 
+void editor_draw_status_bar(struct screen_line *l){
 	char status[80];
 	char rstatus[80];
 
@@ -677,59 +4770,71 @@ void editor_draw_status_bar(struct appendable_str *astr){
 			( St.modified ? "(+)" : ""), 
 			St.num_rows);
 
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %ld/%ld",
-			( St.syntax ? St.syntax->file_type : "No filetype" ),
+	char search[40] = "";
+	if(St.search.active){
+		search_describe(search, sizeof(search) - 3);
+		strcat(search, " | ");
+	}
+	int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %ld/%ld",
+			search,
+			( St.rc.syntax ? St.rc.syntax->file_type : "No filetype" ),
 			St.cx + 1, 
 			St.num_rows);
 
 	if(len > St.screen_cols) len = St.screen_cols;
-	append(astr, status, len);
+	screen_line_put(l, status, len, SCREEN_ATTR_INVERT);
 
 	while(len < St.screen_cols - rlen){
-		append(astr, " ", 1);
+		screen_line_put(l, " ", 1, SCREEN_ATTR_INVERT);
 		len++;
 	}
 
 	if(rlen == St.screen_cols - len) 
-		append(astr, rstatus, rlen);
-
-	append(astr, NORMAL_COLOR_ESQ, strlen(NORMAL_COLOR_ESQ));
-	append(astr, "\r\n", 2);
+		screen_line_put(l, rstatus, rlen, SCREEN_ATTR_INVERT);
 }
 
-void editor_draw_status_message(struct appendable_str *astr){
-	append(astr, CLEAR_LINE, strlen(CLEAR_LINE));
-
-	int len = strlen(St.status_msg);
+void editor_draw_status_message(struct screen_line *l){
+	char stats[128];
+	const char *msg = St.status_msg;
+	if(St.stats.shown){
+		stats_describe(stats, sizeof(stats));
+		msg = stats;
+	}
+	int len = strlen(msg);
 	if(len > St.screen_cols) len = St.screen_cols;
-	if( time(NULL) - St.status_msg_time < 5 )
-		append(astr,St.status_msg, len);
+	screen_line_put(l, msg, len, HL_NORMAL);
 }
 
-void editor_draw_rows(struct appendable_str *astr){
+void editor_draw_rows(){
 	long first_empty_row;
 	if(St.num_rows == 0){
-		first_empty_row = editor_draw_welcome_message_ascii_art(astr);
+		first_empty_row = editor_draw_welcome_message_ascii_art();
 	}
 	else{
-		first_empty_row = editor_draw_file_contents(astr);
+		first_empty_row = editor_draw_file_contents();
 	}
-	editor_draw_empty_rows(astr, first_empty_row);
-	editor_draw_status_bar(astr);
-	editor_draw_status_message(astr);
+	editor_draw_empty_rows(first_empty_row);
+	editor_draw_status_bar(St.back.lines + St.screen_rows);
+	editor_draw_status_message(St.back.lines + St.screen_rows + 1);
 }
 
 void editor_refresh_screen(){
+	long long start = stats_frame_begin();
 	editor_scroll();
 
-	struct appendable_str astr = INIT_APPENDABLE_STR;
+	struct appendable_str *astr = &St.out;
+	astr->len = 0;
 
-	append(&astr, HIDE_CURSOR_ESQ, strlen(HIDE_CURSOR_ESQ));
-	append(&astr, MOVE_CURSOR_TO_TOP_LEFT_ESQ, strlen(MOVE_CURSOR_TO_TOP_LEFT_ESQ));
+	if(St.synchronized_output)
+		append(astr, BEGIN_SYNCHRONIZED_UPDATE_ESQ, strlen(BEGIN_SYNCHRONIZED_UPDATE_ESQ));
+	append(astr, HIDE_CURSOR_ESQ, strlen(HIDE_CURSOR_ESQ));
 
-	editor_draw_rows(&astr);
+	screen_begin_frame();
+	editor_draw_rows();
+	long changed = screen_flush(astr);
+	if(changed == 0) astr->len = 0;    // only the cursor moves
 
-	char cursor_position_update[32];
+	char cursor_position_update[48];    // room for two longs
 
 	snprintf( cursor_position_update, 
 			sizeof(cursor_position_update), 
@@ -737,18 +4842,24 @@ void editor_refresh_screen(){
 			St.cx - St.row_offset + 1, 
 			St.ry - St.col_offset + 1 );
 
-	append(&astr,cursor_position_update, strlen(cursor_position_update));
+	append(astr, cursor_position_update, strlen(cursor_position_update));
 
-	append(&astr, SHOW_CURSOR_ESQ, strlen(SHOW_CURSOR_ESQ));
+	if(changed){
+		append(astr, SHOW_CURSOR_ESQ, strlen(SHOW_CURSOR_ESQ));
+		if(St.synchronized_output)
+			append(astr, END_SYNCHRONIZED_UPDATE_ESQ, strlen(END_SYNCHRONIZED_UPDATE_ESQ));
+	}
 
-	write(STDOUT_FILENO, astr.buf, astr.len);
+	stats_frame_end(start, astr->len);
+	write_all(STDOUT_FILENO, astr->buf, astr->len);
 
-	free_appendable_str(&astr);
+	editor_prefetch_rows();
 }
 
 /* --- terminal --- */
 
 void disable_raw_mode(){
+	write_all(STDOUT_FILENO, DISABLE_BRACKETED_PASTE_ESQ, strlen(DISABLE_BRACKETED_PASTE_ESQ));
 	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &St.orig_termios) == -1 )
 		die("tcsetattr");
 }
@@ -766,12 +4877,186 @@ void enable_raw_mode(){
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;
 
 	if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
 		die("tcsetattr");
 
 	atexit(disable_raw_mode);
+	write_all(STDOUT_FILENO, ENABLE_BRACKETED_PASTE_ESQ, strlen(ENABLE_BRACKETED_PASTE_ESQ));
+}
+
+/* --- events --- */
+
+/* The editor sleeps in poll until a key arrives, the window is resized or
+ * a timer is due. SIGWINCH writes a byte to a pipe so that it wakes the
+ * same poll, and input is read in blocks into St.input and decoded from
+ * there. */
+
+void sigwinch_handler(int sig){
+	(void)sig;
+	int saved_errno = errno;
+	if(write(St.winch_pipe[1], "", 1) == -1){
+		// the pipe is full, so a resize is already pending
+	}
+	errno = saved_errno;
+}
+
+void editor_init_events(){
+	if(pipe(St.winch_pipe) == -1 || pipe(St.wake_pipe) == -1) die("pipe");
+	for(int i = 0; i < 2; i++){
+		fcntl(St.winch_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(St.winch_pipe[i], F_SETFD, FD_CLOEXEC);
+		fcntl(St.wake_pipe[i], F_SETFL, O_NONBLOCK);
+		fcntl(St.wake_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigwinch_handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	if(sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+}
+
+/* Wakes the poll in input_fill() from another thread. */
+void editor_wake(){
+	if(St.wake_pipe[1] < 0) return;
+	if(write(St.wake_pipe[1], "", 1) == -1){
+		// the pipe is full, so a wakeup is already pending
+	}
+}
+
+void editor_handle_wake(){
+	char drain[64];
+	while(read(St.wake_pipe[0], drain, sizeof(drain)) > 0);
+	search_poll();
+}
+
+void editor_handle_resize(){
+	char drain[64];
+	while(read(St.winch_pipe[0], drain, sizeof(drain)) > 0);
+
+	struct winsize ws;
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row < 3) return;
+	St.screen_rows = ws.ws_row - 2;
+	St.screen_cols = ws.ws_col;
+}
+
+long long monotonic_ms(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long monotonic_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void editor_timer_set(int timer, long delay_ms){
+	St.timers[timer] = monotonic_ms() + delay_ms;
+}
+
+void editor_timer_cancel(int timer){
+	St.timers[timer] = 0;
+}
+
+void editor_timer_fire(int timer){
+	St.timers[timer] = 0;
+	switch(timer){
+		case TIMER_STATUS_MESSAGE:
+			St.status_msg[0] = '\0';
+			break;
+		case TIMER_JOURNAL:
+			journal_commit();
+			break;
+	}
+}
+
+/* Returns how long poll may sleep before the next timer is due, or -1
+ * when none is armed. */
+int editor_timer_timeout(){
+	long long now = monotonic_ms(), next = -1;
+	for(int t = 0; t < TIMER_COUNT; t++){
+		if(St.timers[t] == 0) continue;
+		long long left = St.timers[t] - now;
+		if(left < 0) left = 0;
+		if(next == -1 || left < next) next = left;
+	}
+	return next > INT_MAX ? INT_MAX : (int)next;
+}
+
+void editor_run_timers(){
+	long long now = monotonic_ms();
+	for(int t = 0; t < TIMER_COUNT; t++)
+		if(St.timers[t] != 0 && St.timers[t] <= now) editor_timer_fire(t);
+}
+
+/* Waits up to timeout_ms (-1 waits for ever) for input, a resize or a
+ * wakeup from another thread and queues whatever input can be read. Returns the number of bytes queued. */
+int input_fill(int timeout_ms){
+	struct input_queue *in = &St.input;
+	if(in->start > 0){
+		memmove(in->buf, in->buf + in->start, in->len);
+		in->start = 0;
+	}
+
+	struct pollfd fds[3] = {
+		{ STDIN_FILENO, POLLIN, 0 },
+		{ St.winch_pipe[0], POLLIN, 0 },
+		{ St.wake_pipe[0], POLLIN, 0 },
+	};
+	if(poll(fds, 3, timeout_ms) == -1){
+		if(errno == EINTR) return 0;
+		die("poll");
+	}
+
+	if(fds[1].revents & POLLIN) editor_handle_resize();
+	if(fds[2].revents & POLLIN) editor_handle_wake();
+
+	if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)){
+		ssize_t nread = read(STDIN_FILENO, in->buf + in->len, sizeof(in->buf) - in->len);
+		if(nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+		if(nread == 0 && (fds[0].revents & POLLHUP)) die("read");
+		if(nread > 0){
+			in->len += nread;
+			return nread;
+		}
+	}
+	return 0;
+}
+
+/* Takes the next queued byte, waiting up to timeout_ms for one to arrive. */
+bool input_next(char *ch, int timeout_ms){
+	if(St.input.len == 0 && input_fill(timeout_ms) == 0) return false;
+	*ch = St.input.buf[St.input.start++];
+	St.input.len--;
+	return true;
+}
+
+/* Collects the text of a bracketed paste, up to but not including its end
+ * marker. Whatever arrived after the marker is left queued. */
+void input_read_paste(struct appendable_str *paste){
+	long end_len = strlen(PASTE_END_ESQ);
+	while(1){
+		if(St.input.len == 0 && input_fill(PASTE_TIMEOUT_MS) == 0) return;
+
+		long scanned = paste->len - end_len + 1;
+		if(scanned < 0) scanned = 0;
+		append(paste, St.input.buf + St.input.start, St.input.len);
+		St.input.start = St.input.len = 0;
+
+		char *end = memmem(paste->buf + scanned, paste->len - scanned, PASTE_END_ESQ, end_len);
+		if(end){
+			long rest = paste->buf + paste->len - (end + end_len);
+			memcpy(St.input.buf, paste->buf + paste->len - rest, rest);
+			St.input.len = rest;
+			paste->len = end - paste->buf;
+			return;
+		}
+	}
 }
 
 /* --- syntax highlight --- */
@@ -780,44 +5065,193 @@ bool is_separator(int c) {
 	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[]{};", c) != NULL;
 }
 
-void editor_update_syntax(erow *row){
+/* Keywords are looked up in a perfect hash built once per syntax. The seed
+ * is searched for until every keyword lands in a slot of its own, so a
+ * token costs one hash of its length and first and last characters, one
+ * probe and one memcmp. A trailing '|' in the keyword list still marks an
+ * HL_KEYWORD_2 keyword. */
+
+#define KEYWORD_HASH_TRIES 1024
+
+unsigned keyword_hash(const char *s, int len, unsigned seed, bool full_hash){
+	unsigned h = seed ^ ((unsigned)len * 0x9e3779b1u);
+	if(full_hash){
+		for(int i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 0x01000193u;
+	}
+	else{
+		h = (h ^ (unsigned char)s[0]) * 0x01000193u;
+		h = (h ^ (unsigned char)s[len > 1]) * 0x01000193u;
+		h = (h ^ (unsigned char)s[len - 1]) * 0x01000193u;
+	}
+	return h ^ (h >> 15);
+}
+
+/* Places every keyword with the given seed, failing on the first slot
+ * two different keywords want. Repeated keywords keep their first entry. */
+bool keyword_table_place(struct keyword_table *t, char **keywords){
+	memset(t->slots, 0, sizeof(struct keyword_slot) * (t->mask + 1));
+	for(char **kws = keywords; *kws; kws++){
+		int len = strlen(*kws);
+		int hl = HL_KEYWORD_1;
+		if(len > 0 && (*kws)[len - 1] == '|'){
+			len--;
+			hl = HL_KEYWORD_2;
+		}
+		if(len == 0) continue;
+
+		struct keyword_slot *slot = t->slots + (keyword_hash(*kws, len, t->seed, t->full_hash) & t->mask);
+		if(slot->word){
+			if(slot->len == len && memcmp(slot->word, *kws, len) == 0) continue;
+			return false;
+		}
+		slot->word = *kws;
+		slot->len = len;
+		slot->hl = hl;
+		if(len > t->max_len) t->max_len = len;
+	}
+	return true;
+}
+
+void keyword_table_build(struct keyword_table *t, char **keywords){
+	int n = 0;
+	while(keywords[n]) n++;
+
+	unsigned size = 4;
+	while(size < 2u * n) size <<= 1;
+
+	t->full_hash = false;
+	for(;;){
+		t->slots = xmalloc(sizeof(struct keyword_slot) * size);
+		if(t->slots == NULL) die("malloc");
+		t->mask = size - 1;
+		for(unsigned seed = 0; seed < KEYWORD_HASH_TRIES; seed++){
+			t->seed = seed * 0x6c8e9cf5u;
+			t->max_len = 0;
+			if(keyword_table_place(t, keywords)) return;
+		}
+		xfree(t->slots);
+
+		// keywords sharing length and end characters need every byte hashed
+		if(size >= 16u * n + 16){
+			if(t->full_hash) die("keyword_table_build");
+			t->full_hash = true;
+			size = 4;
+			while(size < 2u * n) size <<= 1;
+		}
+		else{
+			size <<= 1;
+		}
+	}
+}
+
+/* Returns the highlight of the keyword s[0..len), or HL_NORMAL. */
+int keyword_table_lookup(struct keyword_table *t, const char *s, int len){
+	if(len == 0 || len > t->max_len) return HL_NORMAL;
+	struct keyword_slot *slot = t->slots + (keyword_hash(s, len, t->seed, t->full_hash) & t->mask);
+	if(slot->len == len && memcmp(slot->word, s, len) == 0) return slot->hl;
+	return HL_NORMAL;
+}
+
+/* How far past its position the lexer may look before deciding what a
+ * character is. */
+long row_lex_lookahead(const struct row_context *ctx){
+	if(ctx->syntax == NULL) return 0;
+	long n = ctx->syntax->keyword_table.max_len + 1;
+	char *markers[] = { ctx->syntax->singleline_comment_start,
+		ctx->syntax->multiline_comment_start, ctx->syntax->multiline_comment_end };
+	for(int i = 0; i < 3; i++)
+		if(markers[i] && (long)strlen(markers[i]) > n) n = strlen(markers[i]);
+	return n + 1;
+}
+
+/* Highlights one row, starting the lexer in row->hl_start_state. After a
+ * partial render the lexer resumes at the checkpoint it was given, and
+ * stops as soon as it reaches an old checkpoint in the state it was in
+ * when the rest of hl was made. */
+void row_highlight(struct row_context *ctx, erow *row){
+	struct row_index *ix = row->index;
+	long nckpt = ( ix ? ix->nckpt : 0 );
+	bool resume = ctx->lex_resume.row == row && ( ctx->syntax == NULL ||
+		(ix->ckpt[0].lexed && ix->ckpt[0].st.inside_comment == row->hl_start_state) );
+	ctx->lex_resume.row = NULL;
+
+	if(resume && ctx->syntax == NULL){
+		long from = ix->ckpt[ctx->lex_resume.k].r;
+		long to = ( ctx->lex_resume.converge < nckpt ? ix->ckpt[ctx->lex_resume.converge].r : row->rsize );
+		if(row->hl) hl_fill(row->hl, from, HL_NORMAL, to - from);
+		row->hl_open_comment = 0;
+		return;
+	}
 
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+	long k = 0, converge = nckpt;
+	struct lex_state st = { true, 0, row->hl_start_state };
+	long y = 0;
+	if(resume){
+		k = ctx->lex_resume.k;
+		converge = ctx->lex_resume.converge;
+		st = ix->ckpt[k].st;
+		y = ix->ckpt[k].r;
+	}
+	else{
+		xfree(row->hl);
+		row->hl = NULL;
+	}
 
-	if(St.syntax == NULL) return;	
+	if(ctx->syntax == NULL){
+		row->hl_open_comment = 0;
+		return;
+	}
+	if(row->hl == NULL){
+		row->hl = xcalloc(hl_bytes(row->rsize), 1);
+		if(row->hl == NULL) die("calloc");
+	}
 
 	unsigned char *hl = row->hl;
-	char **keywords = St.syntax->keywords;
 
-	char *slcs = St.syntax->singleline_comment_start;
-	char *mlcs = St.syntax->multiline_comment_start;
-	char *mlce = St.syntax->multiline_comment_end;
+	char *slcs = ctx->syntax->singleline_comment_start;
+	char *mlcs = ctx->syntax->multiline_comment_start;
+	char *mlce = ctx->syntax->multiline_comment_end;
 
 	int slcs_len = strlen(slcs);
 	int mlcs_len = strlen(mlcs);
 	int mlce_len = strlen(mlce);
 
 
-	bool is_prev_sep = true;
-	char inside_string = 0; 
-	char inside_comment = (row->idx > 0 && St.rows[row->idx - 1].hl_open_comment);
+	bool is_prev_sep = st.is_prev_sep;
+	char inside_string = st.inside_string;
+	char inside_comment = st.inside_comment;
 
-	int y = 0;
 	while(y < row->rsize){
 		char ch = row->render[y];
-		unsigned char prev_hl = ( y > 0 ? row->hl[y-1] : HL_NORMAL );
+		unsigned char prev_hl = ( y > 0 ? hl_get(hl, y - 1) : HL_NORMAL );
+
+		while(k < nckpt && ix->ckpt[k].r < y) ix->ckpt[k++].lexed = false;
+		if(k < nckpt && ix->ckpt[k].r == y){
+			struct row_checkpoint *cp = ix->ckpt + k;
+			char prev_ch = ( y > 0 ? row->render[y-1] : 0 );
+			if(k >= converge && cp->lexed && cp->st.is_prev_sep == is_prev_sep &&
+					cp->st.inside_string == inside_string && cp->st.inside_comment == inside_comment &&
+					cp->prev_hl == prev_hl && cp->prev_ch == prev_ch)
+				return;    // the rest of the row lexes as it did before
+			cp->lexed = true;
+			cp->st.is_prev_sep = is_prev_sep;
+			cp->st.inside_string = inside_string;
+			cp->st.inside_comment = inside_comment;
+			cp->prev_hl = prev_hl;
+			cp->prev_ch = prev_ch;
+			k++;
+		}
 
 		if(slcs && !inside_string && !inside_comment){
 			if(strncmp(slcs, row->render + y, slcs_len) == 0){
-				memset(row->hl + y, HL_COMMENT, row->rsize - y);
+				hl_fill(hl, y, HL_COMMENT, row->rsize - y);
 				break;
 			}
 		}
 
-		if(St.syntax->flags & HL_HIGHLIGHT_STRINGS){
+		if(ctx->syntax->flags & HL_HIGHLIGHT_STRINGS){
 			if(inside_string){
-				hl[y] = HL_STRING;
+				hl_set(hl, y, HL_STRING);
 				if(inside_string == ch && row->render[y-1] != '\\') inside_string = 0;
 				is_prev_sep = true;
 				y++;
@@ -825,7 +5259,7 @@ void editor_update_syntax(erow *row){
 			}
 			else if(ch == '"' || ch == '\''){
 				inside_string = ch;
-				row->hl[y] = HL_STRING;
+				hl_set(hl, y, HL_STRING);
 				y++;
 				continue;
 			}
@@ -833,9 +5267,9 @@ void editor_update_syntax(erow *row){
 
 		if(mlcs && mlcs  && !inside_string){
 			if(inside_comment){
-				hl[y] = HL_COMMENT;
+				hl_set(hl, y, HL_COMMENT);
 				if(! strncmp(mlce, row->render + y, mlce_len)){
-					memset(hl + y, HL_COMMENT, mlce_len);
+					hl_fill(hl, y, HL_COMMENT, mlce_len);
 			 		y += mlce_len;
 					inside_comment = 0;
 				}
@@ -845,17 +5279,17 @@ void editor_update_syntax(erow *row){
 				}
 			}
 			else if(! strncmp(row->render + y, mlcs, mlcs_len)){
-				memset(hl + y, HL_COMMENT, mlcs_len);
+				hl_fill(hl, y, HL_COMMENT, mlcs_len);
 				y += mlcs_len;
 				inside_comment = 1;
 				continue;
 			}
 		}
 
-		if(St.syntax->flags & HL_HIGHLIGHT_NUMBERS){
+		if(ctx->syntax->flags & HL_HIGHLIGHT_NUMBERS){
 			if((isdigit(ch) && ( is_prev_sep || prev_hl == HL_NUMBER )) || 
 					( ch == '.' && prev_hl == HL_NUMBER )){
-				row->hl[y] = HL_NUMBER;
+				hl_set(hl, y, HL_NUMBER);
 				y++;
 				is_prev_sep = false;
 				continue;
@@ -863,20 +5297,14 @@ void editor_update_syntax(erow *row){
 		}
 
 		if(is_prev_sep){
-			char **kws = keywords;
-			int kw_len; 
-			bool is_keyword_2;
-			while(*kws){
-				kw_len = strlen(*kws);
-				is_keyword_2 = (*kws)[kw_len - 1] == '|';
-				if(is_keyword_2) kw_len--;
-				if(! strncmp(*kws, row->render + y, kw_len) && is_separator(row->render[y + kw_len])) break;
-				kws++;
-			}
-
-			if(*kws){
-				int HL_KEYWORD = ( is_keyword_2 ? HL_KEYWORD_2 : HL_KEYWORD_1 );
-				memset(row->hl + y, HL_KEYWORD, kw_len);
+			struct keyword_table *kwt = &ctx->syntax->keyword_table;
+			int kw_len = 0;
+			while(kw_len <= kwt->max_len && y + kw_len < row->rsize && !is_separator(row->render[y + kw_len]))
+				kw_len++;
+
+			int HL_KEYWORD = keyword_table_lookup(kwt, row->render + y, kw_len);
+			if(HL_KEYWORD != HL_NORMAL){
+				hl_fill(hl, y, HL_KEYWORD, kw_len);
 				y += kw_len;
 				is_prev_sep = false;
 				continue;
@@ -884,12 +5312,265 @@ void editor_update_syntax(erow *row){
 		}
 
 		is_prev_sep = is_separator(ch);
+		hl_set(hl, y, HL_NORMAL);
 		y++;
 	} 
-	int changed = (row->hl_open_comment != inside_comment);
+	while(k < nckpt) ix->ckpt[k++].lexed = false;
 	row->hl_open_comment = inside_comment;
-	if (changed && row->idx + 1 < St.num_rows)
-		editor_update_syntax(&St.rows[row->idx + 1]);
+
+	if(!resume && hl_is_plain(hl, row->rsize)){
+		xfree(row->hl);
+		row->hl = NULL;
+	}
+}
+
+/* Returns the comment state row_highlight() would end text in when
+ * started in `state`, without highlighting anything. Only what can open
+ * or close a comment is looked at: comment markers and quotes, along
+ * with the lexer's quirks around them. A quote starts a string even
+ * inside a block comment, and the character right after a comment ends
+ * is skipped. */
+int row_scan_comment(const struct row_context *ctx, const char *text, long len, int state){
+	const struct editor_syntax *syntax = ctx->syntax;
+	if(syntax == NULL) return 0;
+	const char *slcs = syntax->singleline_comment_start;
+	const char *mlcs = syntax->multiline_comment_start;
+	const char *mlce = syntax->multiline_comment_end;
+	long slcs_len = ( slcs ? (long)strlen(slcs) : 0 );
+	long mlcs_len = ( mlcs ? (long)strlen(mlcs) : 0 );
+	long mlce_len = ( mlce ? (long)strlen(mlce) : 0 );
+	bool strings = syntax->flags & HL_HIGHLIGHT_STRINGS;
+
+	char s0 = ( slcs ? slcs[0] : 0 ), m0 = ( mlcs ? mlcs[0] : 0 ), e0 = ( mlce ? mlce[0] : 0 );
+
+	char inside_string = 0;
+	int inside_comment = state;
+	for(long y = 0; y < len; ){
+		char ch = text[y];
+		if(ch != s0 && ch != m0 && ch != e0 && ch != '"' && ch != '\''){
+			y++;
+			continue;
+		}
+		if(slcs && !inside_string && !inside_comment &&
+				y + slcs_len <= len && memcmp(text + y, slcs, slcs_len) == 0)
+			break;
+
+		if(strings){
+			if(inside_string){
+				if(inside_string == ch && text[y-1] != '\\') inside_string = 0;
+				y++;
+				continue;
+			}
+			if(ch == '"' || ch == '\''){
+				inside_string = ch;
+				y++;
+				continue;
+			}
+		}
+
+		if(mlcs && mlce){
+			if(inside_comment){
+				if(y + mlce_len <= len && memcmp(text + y, mlce, mlce_len) == 0){
+					y += mlce_len + 1;
+					inside_comment = 0;
+				}
+				else{
+					y++;
+				}
+				continue;
+			}
+			if(y + mlcs_len <= len && memcmp(text + y, mlcs, mlcs_len) == 0){
+				y += mlcs_len;
+				inside_comment = 1;
+				continue;
+			}
+		}
+		y++;
+	}
+	return inside_comment;
+}
+
+/* Carries comment state `state` down the rows next(arg) hands out,
+ * lexing each again under ctx, until one was already highlighted starting
+ * in that state. Leaves in *state the state to go on with once next()
+ * runs out, or -1 if the rows took it in before then. Returns the rows
+ * lexed. */
+long row_cascade(struct row_context *ctx, erow *(*next)(void *), void *arg, int *state){
+	long lexed = 0;
+	erow *row;
+	while((row = next(arg))){
+		if(row->hl_start_state == *state){
+			*state = -1;
+			break;
+		}
+		row->hl_start_state = *state;
+		row_highlight(ctx, row);
+		lexed++;
+		*state = row->hl_open_comment;
+	}
+	return lexed;
+}
+
+struct syntax_walk{
+	struct row_iter it;
+	bool more;
+	long end;
+	erow *last;       // the last row handed out
+	long last_at;
+};
+
+/* Hands row_cascade() the rows of a walk for as long as they are rendered
+ * and before its end. */
+erow *editor_syntax_next(void *arg){
+	struct syntax_walk *w = arg;
+	if(!w->more || w->it.at >= w->end || w->it.piece->rows == NULL) return NULL;
+	erow *row = w->it.piece->rows + w->it.offset;
+	if(row->gen != St.rc.render_gen) return NULL;
+	w->last = row;
+	w->last_at = w->it.at;
+	w->more = row_iter_step(&w->it, 1);
+	return row;
+}
+
+/* Carries comment state `state` into row x and down the rows below it,
+ * until a row past `through` was already highlighted with that state.
+ * Rendered rows are lexed again. Rows still in the mapping are only
+ * scanned, and the walk also ends at a line past `through` whose kept
+ * map_comment_state() already matches. Stale rows are scanned too when
+ * scan_stale is set; otherwise the walk stops at one, since it is about
+ * to be rendered, and marks it dirty in case it isn't. The walk stops
+ * before row `end`, and marks the rows from there to `through` dirty so
+ * they are carried on with once they are needed. */
+void editor_syntax_carry(long x, int state, long through, long end, bool scan_stale){
+	struct syntax_walk w = { .end = end };
+	struct row_iter *it = &w.it;
+	w.more = row_iter_seek(it, x);
+	while(w.more){
+		long lexed = row_cascade(&St.rc, editor_syntax_next, &w, &state);
+		STAT_ADD(key_hl, lexed);
+		STAT_ADD(key_cascade, lexed);
+		if(state < 0){
+			if(w.last_at >= through) return;
+			state = w.last->hl_open_comment;    // the rows below it may still be behind
+			continue;
+		}
+		if(!w.more) return;
+		if(it->at >= end){
+			editor_syntax_dirty(it->at, 0);
+			if(through > it->at) editor_syntax_dirty(through, 0);
+			return;
+		}
+
+		erow *row = ( it->piece->rows ? it->piece->rows + it->offset : NULL );
+		if(row){
+			row->hl_start_state = state;
+			if(!scan_stale){
+				editor_syntax_dirty(it->at, 0);
+				if(through > it->at) editor_syntax_dirty(through, 0);
+				return;
+			}
+		}
+		else{
+			long line = it->piece->file_line + it->offset;
+			if(line % MAP_STATE_LINES == 0){
+				signed char *kept = map_comment_state(line);
+				if(*kept == state && it->at >= through) return;
+				*kept = state;
+			}
+		}
+		long len;
+		const char *text = row_iter_text(it, &len);
+		state = row_scan_comment(&St.rc, text, len, state);
+		w.more = row_iter_step(it, 1);
+	}
+}
+
+/* Returns the comment state at the start of row `at`. That is the end
+ * state of the row above when it is rendered; otherwise the rows above
+ * are scanned from the nearest one whose state is known, a rendered row
+ * or a mapped line with a kept state, or from the top. */
+int editor_syntax_state_before(long at){
+	erow *prev = editor_row_peek(at - 1);
+	if(prev && prev->gen == St.rc.render_gen) return prev->hl_open_comment;
+	if(St.rc.syntax == NULL) return 0;
+
+	struct row_iter it;
+	long x = at - 1, from = 0;
+	int state = 0;
+	while(row_iter_seek(&it, x)){
+		if(it.piece->rows){
+			erow *row = it.piece->rows + it.offset;
+			if(row->gen == St.rc.render_gen){
+				state = row->hl_open_comment;
+				from = x + 1;
+				break;
+			}
+			x--;
+			continue;
+		}
+		long line = it.piece->file_line + it.offset;
+		long kept = line - line % MAP_STATE_LINES;
+		while(kept >= it.piece->file_line && *map_comment_state(kept) < 0) kept -= MAP_STATE_LINES;
+		if(kept >= it.piece->file_line){
+			state = *map_comment_state(kept);
+			from = x - (line - kept);
+			break;
+		}
+		x -= it.offset + 1;
+	}
+
+	for(bool more = row_iter_seek(&it, from); more && it.at < at; more = row_iter_step(&it, 1)){
+		if(it.piece->rows){
+			it.piece->rows[it.offset].hl_start_state = state;
+		}
+		else{
+			long line = it.piece->file_line + it.offset;
+			if(line % MAP_STATE_LINES == 0) *map_comment_state(line) = state;
+		}
+		long len;
+		const char *text = row_iter_text(&it, &len);
+		state = row_scan_comment(&St.rc, text, len, state);
+	}
+	return state;
+}
+
+/* Highlights row `at` and pushes its multiline comment state down the
+ * rows below, as far as the bottom of the prefetch window. Rows are
+ * rendered before the screen scrolls to the cursor, so the window is the
+ * one that will show row `at`, not the one showing now. */
+void editor_update_syntax(long at){
+	erow *row = editor_row(at);
+	row->hl_start_state = editor_syntax_state_before(at);
+	row_highlight(&St.rc, row);
+	STAT_ADD(key_hl, 1);
+
+	long top = ( at >= St.row_offset + St.screen_rows ? at - St.screen_rows + 1 : St.row_offset );
+	long limit = top + St.screen_rows + SEDIT_RENDER_PREFETCH;
+	editor_syntax_carry(at + 1, row->hl_open_comment, -1, limit, false);
+}
+
+/* Notes that the comment state flowing into row `at` may have changed,
+ * after `shift` rows were inserted there, or removed for a negative one.
+ * The dirty rows are kept as the span from St.hl_dirty_from to
+ * St.hl_dirty_to, every row of which is carried through on catching up,
+ * so a point deferred deep down isn't lost when one above it comes along
+ * and converges early. */
+void editor_syntax_dirty(long at, long shift){
+	if(St.hl_dirty_to >= at) St.hl_dirty_to = ( St.hl_dirty_to + shift < at ? at : St.hl_dirty_to + shift );
+	if(at < St.hl_dirty_from) St.hl_dirty_from = at;
+	if(at > St.hl_dirty_to) St.hl_dirty_to = at;
+}
+
+/* Resumes propagation deferred by editor_update_syntax() or left by
+ * edits to rows that haven't been rendered, until every row up to `at`
+ * has the comment state of the rows above it. */
+void editor_syntax_catch_up(long at){
+	while(St.hl_dirty_from <= at){
+		long x = St.hl_dirty_from, through = St.hl_dirty_to;
+		St.hl_dirty_from = LONG_MAX;
+		St.hl_dirty_to = -1;
+		editor_syntax_carry(x, editor_syntax_state_before(x), through, at + 1, true);
+	}
 }
 
 int editor_syntax_to_color(int hl) {
@@ -905,7 +5586,9 @@ int editor_syntax_to_color(int hl) {
 }
 
 void editor_select_syntax_highlight(){
-	St.syntax = NULL;
+	St.rc.syntax = NULL;
+	St.rc.render_gen++;
+	map_forget_comment_state(0, St.map.lines);
 	if(St.file_name == NULL) return;
 
 	char *ext = strchr(St.file_name, '.');
@@ -916,10 +5599,9 @@ void editor_select_syntax_highlight(){
 		char **entry_match = HLDB[i].file_match;
 		while(*entry_match){
 			if(strcmp(*entry_match, ext) == 0){
-				St.syntax = &HLDB[i];
-
-				for(long x = 0; x < St.num_rows; x++) 
-					editor_update_syntax(St.rows + x);
+				St.rc.syntax = &HLDB[i];
+				if(St.rc.syntax->keyword_table.slots == NULL)
+					keyword_table_build(&St.rc.syntax->keyword_table, St.rc.syntax->keywords);
 
 				return;
 			}
@@ -931,33 +5613,50 @@ void editor_select_syntax_highlight(){
 /* --- input --- */
 
 
+/* Returns the next key, redrawing the screen while it waits whenever the
+ * window is resized or a timer goes off. */
 int editor_read_key(){
-	int nread;
-	char ch;
-	while((nread = read(STDIN_FILENO, &ch, 1)) != 1){
-		if(nread == -1 && errno != EAGAIN) 
-			die("read");
+	while(St.input.len == 0){
+		if(input_fill(editor_timer_timeout()) > 0) break;
+		editor_run_timers();
+		editor_refresh_screen();
 	}
 
+	char ch;
+	if(!input_next(&ch, 0)) return editor_read_key();
+
 	if(ch == ESC){
 		char buf[3];
-		if(read(STDIN_FILENO, &buf[0], 1) == 0) return ESC;
-		if(read(STDIN_FILENO, &buf[1], 1) == 0) return ESC;
+		if(!input_next(&buf[0], ESC_SEQUENCE_TIMEOUT_MS)) return ESC;
+		if(!input_next(&buf[1], ESC_SEQUENCE_TIMEOUT_MS)) return ESC;
 
 		if(buf[0] == '['){
 
+			if(buf[1] == '?'){
+				// a terminal reply that came too late for the probe that asked
+				do{
+					if(!input_next(&buf[2], ESC_SEQUENCE_TIMEOUT_MS)) return ESC;
+				} while(buf[2] < '@' || buf[2] > '~');
+				return editor_read_key();
+			}
 			if('0' <= buf[1] && buf[1] <= '9'){
-				if(read(STDIN_FILENO, &buf[2], 1) == 0) return ESC;
+				int code = buf[1] - '0';
+				while(1){
+					if(!input_next(&buf[2], ESC_SEQUENCE_TIMEOUT_MS)) return ESC;
+					if(buf[2] < '0' || buf[2] > '9' || code >= 1000) break;
+					code = code * 10 + buf[2] - '0';
+				}
 
 				if(buf[2] == '~'){
-					switch(buf[1]){
-						case '1': return HOME;
-						case '3': return DEL_KEY;
-						case '4': return END;
-						case '5': return PAGE_UP;
-						case '6': return PAGE_DOWN;
-						case '7': return HOME;
-						case '8': return END;
+					switch(code){
+						case 1: return HOME;
+						case 3: return DEL_KEY;
+						case 4: return END;
+						case 5: return PAGE_UP;
+						case 6: return PAGE_DOWN;
+						case 7: return HOME;
+						case 8: return END;
+						case 200: return PASTE_START;
 					}
 				}
 			}
@@ -987,13 +5686,13 @@ int editor_read_key(){
 }
 
 void editor_move_cursor(int key){
-	erow *this_row = ( St.cx >= St.num_rows ? NULL : St.rows + St.cx);
+	erow *this_row = editor_row(St.cx);
 	switch(key){
 		case ARROW_LEFT:
 			if(St.cy > 0) St.cy--;
 			else if(St.cx > 0){
 				St.cx--;
-				St.cy = St.rows[St.cx].size;
+				St.cy = editor_row(St.cx)->size;
 			}
 			break;
 
@@ -1014,7 +5713,7 @@ void editor_move_cursor(int key){
 			break;
 
 	}
-	this_row = ( St.cx >= St.num_rows ? NULL : St.rows + St.cx);  
+	this_row = editor_row(St.cx);
 	long len = (this_row ? this_row->size : 0 );
 	if( St.cy > len ) St.cy = len;
 
@@ -1022,7 +5721,10 @@ void editor_move_cursor(int key){
 
 void editor_process_keypress(){
 	int ch = editor_read_key();
+	erow *row;
 
+	stats_key();
+	undo_boundary();
 	switch(ch){
 		case '\r':
 			editor_insert_newline_at_cursor();
@@ -1035,6 +5737,7 @@ void editor_process_keypress(){
 				return;
 			}
 			else{
+				journal_discard();
 				CLEAR_SCREEN();
 				REPOSITION_CURSOR();
 				exit(0);
@@ -1045,16 +5748,37 @@ void editor_process_keypress(){
 			editor_find();
 			break;
 
+		case CTRL_KEY('r'):
+			editor_replace();
+			break;
+
+		case PASTE_START:
+			editor_paste();
+			break;
+
 		case CTRL_KEY('s'):
 			editor_save_file();
 			break;
 
+		case CTRL_KEY('z'):
+			editor_undo();
+			break;
+
+		case CTRL_KEY('y'):
+			editor_redo();
+			break;
+
+		case CTRL_KEY('d'):
+			stats_toggle();
+			break;
+
 		case PAGE_UP:
 			St.row_offset -= St.screen_rows - 1;
 			St.cx -= St.screen_rows - 1;
 			if(St.row_offset < 0) St.row_offset = 0;
 			if(St.cx < 0) St.cx = 0;
-			if(St.cy > St.rows[St.cx].size) St.cy = St.rows[St.cx].size;
+			row = editor_row(St.cx);
+			if(St.cy > (row ? row->size : 0)) St.cy = (row ? row->size : 0);
 			break;
 
 		case PAGE_DOWN:
@@ -1064,7 +5788,8 @@ void editor_process_keypress(){
 				St.row_offset = St.num_rows - St.screen_rows;
 			if(St.cx > St.num_rows - St.screen_rows - 1) 
 				St.cx = St.row_offset + St.screen_rows - 1;
-			if(St.cy > St.rows[St.cx].size) St.cy = St.rows[St.cx].size;
+			row = editor_row(St.cx);
+			if(St.cy > (row ? row->size : 0)) St.cy = (row ? row->size : 0);
 			break;
 
 		case HOME:
@@ -1072,7 +5797,7 @@ void editor_process_keypress(){
 			break;
 
 		case END:
-			if(St.cx < St.num_rows) St.cy = St.rows[St.cx].size;
+			if(St.cx < St.num_rows) St.cy = editor_row(St.cx)->size;
 			break;
 
 		case DEL_KEY: 
@@ -1109,27 +5834,31 @@ void editor_set_status_message(const char *format, ...){
 	va_start(ap, format);
 	vsnprintf(St.status_msg, sizeof(St.status_msg), format, ap);
 	va_end(ap);
-	St.status_msg_time = time(NULL);
+	editor_timer_set(TIMER_STATUS_MESSAGE, STATUS_MESSAGE_TIMEOUT_MS);
 }
 
-char* editor_prompt(const char *prompt, void (*callback)(char *,int)){
+/* Shows prompt in the status bar and returns what is typed at it, or NULL
+ * if Esc is pressed. Enter on an empty answer is ignored unless
+ * allow_empty. */
+char* editor_prompt(const char *prompt, void (*callback)(char *,int), bool allow_empty){
 	size_t bufsize = 128, buflen = 0;
-	char *input_buffer = malloc(bufsize);
+	char *input_buffer = xmalloc(bufsize);
 	input_buffer[0] = '\0';
 
 	while(1){
 		editor_set_status_message(prompt, input_buffer);
+		editor_timer_cancel(TIMER_STATUS_MESSAGE);    // the prompt stays up until answered
 		editor_refresh_screen();
 
 		int key = editor_read_key();
 
-		if(key == '\r' && buflen > 0){
+		if(key == '\r' && (buflen > 0 || allow_empty)){
 			editor_set_status_message("");
 			if(callback) callback(input_buffer, key);
 			return input_buffer;
 		}
 		else if(key == ESC){
-			free(input_buffer);
+			xfree(input_buffer);
 			editor_set_status_message("");
 			if(callback) callback(input_buffer, key);
 			return NULL;
@@ -1138,10 +5867,25 @@ char* editor_prompt(const char *prompt, void (*callback)(char *,int)){
 			editor_set_status_message("");
 			if(buflen > 0) input_buffer[--buflen] = '\0';
 		}
+		else if(key == PASTE_START){
+			// only the first line of a paste goes into the prompt
+			struct appendable_str paste = INIT_APPENDABLE_STR
+			input_read_paste(&paste);
+			for(long i = 0; i < paste.len && paste.buf[i] != '\r' && paste.buf[i] != '\n'; i++){
+				if(iscntrl((unsigned char)paste.buf[i])) continue;
+				if(buflen == bufsize - 1){
+					bufsize *= 2;
+					input_buffer = xrealloc(input_buffer, bufsize);
+				}
+				input_buffer[buflen++] = paste.buf[i];
+			}
+			input_buffer[buflen] = '\0';
+			xfree(paste.buf);
+		}
 		else if(!iscntrl(key) && key < 128){
 			if(buflen == bufsize - 1){
 				bufsize *= 2;
-				input_buffer = realloc(input_buffer, bufsize);
+				input_buffer = xrealloc(input_buffer, bufsize);
 			}
 			input_buffer[buflen++] = key;
 			input_buffer[buflen] = '\0';
@@ -1151,16 +5895,346 @@ char* editor_prompt(const char *prompt, void (*callback)(char *,int)){
 }
 
 
+/* --- batch --- */
+
+/* `sedit --batch script [file]` applies a script of edits to file, or to
+ * an empty buffer, without a terminal. Nothing is rendered: each command
+ * goes straight to the editing functions the keys use. The script is
+ * read whole, "-" meaning stdin, and holds one command a line:
+ *
+ *   goto LINE [COL]      put the cursor on LINE at COL, both from 1
+ *   insert TEXT          insert TEXT at the cursor and move past it;
+ *                        \n starts a new line, \t is a tab, \\ a backslash
+ *   delete [N]           delete N characters at the cursor, 1 if not
+ *                        given, a line break counting as one
+ *   find TEXT            move to the next match after the cursor,
+ *                        wrapping around; the cursor stays if there is none
+ *   replace /FROM/TO/    replace every match of FROM with TO; any
+ *                        character can stand in for the /
+ *   regex on|off         read find and replace patterns as regexes
+ *   save [PATH]          write the buffer to PATH, or to the file; "-"
+ *                        writes it to stdout
+ *
+ * Blank lines and lines starting with # are skipped. A bad command stops
+ * the script with a message on stderr. */
+
+struct batch{
+	const char *script;
+	long line;                        // of the script, from 1
+	struct appendable_str arg;        // the argument with escapes undone
+};
+
+bool batch_fail(struct batch *b, const char *format, ...){
+	va_list ap;
+	va_start(ap, format);
+	fprintf(stderr, "%s:%ld: ", b->script, b->line);
+	vfprintf(stderr, format, ap);
+	fputc('\n', stderr);
+	va_end(ap);
+	return false;
+}
+
+/* Reads all of fd into a nul terminated buffer. */
+char *batch_read(int fd, long *len){
+	struct appendable_str s = INIT_APPENDABLE_STR
+	char chunk[65536];
+	ssize_t n;
+	while((n = read(fd, chunk, sizeof(chunk))) != 0){
+		if(n < 0){
+			if(errno == EINTR) continue;
+			xfree(s.buf);
+			return NULL;
+		}
+		append(&s, chunk, n);
+	}
+	append(&s, "", 1);
+	*len = s.len - 1;
+	return s.buf;
+}
+
+/* Puts s, with its escapes undone, in b->arg. */
+void batch_unescape(struct batch *b, const char *s, long len){
+	b->arg.len = 0;
+	long from = 0;
+	for(long i = 0; i < len; i++){
+		if(s[i] != '\\' || i + 1 == len) continue;
+		append(&b->arg, s + from, i - from);
+		char c = s[++i];
+		c = ( c == 'n' ? '\n' : c == 't' ? '\t' : c );
+		append(&b->arg, &c, 1);
+		from = i + 1;
+	}
+	append(&b->arg, s + from, len - from);
+}
+
+/* Parses a number from 1 at *s, moving *s past it. */
+bool batch_number(const char **s, long *v){
+	char *end;
+	errno = 0;
+	*v = strtol(*s, &end, 10);
+	if(end == *s || errno || *v < 1) return false;
+	*s = end;
+	while(**s == ' ') (*s)++;
+	return true;
+}
+
+bool batch_goto(struct batch *b, const char *arg){
+	long line, col = 1;
+	if(!batch_number(&arg, &line) || (*arg && !batch_number(&arg, &col)) || *arg)
+		return batch_fail(b, "goto takes a line and a column");
+	St.cx = ( line - 1 < St.num_rows ? line - 1 : St.num_rows );
+	erow *row = editor_row(St.cx);
+	long size = ( row ? row->size : 0 );
+	St.cy = ( col - 1 < size ? col - 1 : size );
+	return true;
+}
+
+void batch_delete(long n){
+	while(n > 0 && !cursor_below_last_line()){
+		erow *row = editor_row(St.cx);
+		long k = row->size - St.cy;
+		if(k > n) k = n;
+		if(k > 0){
+			editor_row_delete_text(St.cx, St.cy, k);
+			n -= k;
+		}
+		else if(St.cx == St.num_rows - 1){
+			break;
+		}
+		else{
+			editor_delete_character_at_cursor();
+			n--;
+		}
+	}
+}
+
+/* Compiles the pattern for find and replace. */
+bool batch_pattern(struct batch *b, const char *s, long len){
+	if(!St.search.regex){
+		batch_unescape(b, s, len);
+		s = b->arg.buf;
+		len = b->arg.len;
+	}
+	if(len == 0) return batch_fail(b, "empty pattern");
+	search_use_query(s, len);
+	if(St.search.pattern.error) return batch_fail(b, "bad regex: %s", St.search.pattern.error);
+	return true;
+}
+
+void batch_find(){
+	struct search *s = &St.search;
+	if(St.num_rows == 0) return;
+	editor_gap_close();
+	if(s->matcher) s->matcher->text = NULL;    // rows may have changed under the same text
+
+	struct row_iter it;
+	bool below = cursor_below_last_line();
+	row_iter_seek(&it, ( below ? 0 : St.cx ));
+	for(long i = 0; i <= St.num_rows; i++){
+		long len, end;
+		const char *text = row_iter_text(&it, &len);
+		long at = search_next(&s->pattern, s->matcher, text, len, ( i == 0 && !below ? St.cy + 1 : 0 ), &end);
+		if(at >= 0){
+			St.cx = it.at;
+			St.cy = at;
+			return;
+		}
+		if(!row_iter_step(&it, 1)) row_iter_seek(&it, 0);
+	}
+}
+
+bool batch_replace(struct batch *b, const char *arg){
+	char delim = arg[0];
+	const char *from = arg + 1;
+	const char *mid = ( delim ? strchr(from, delim) : NULL );
+	if(mid == NULL) return batch_fail(b, "replace takes /FROM/TO/");
+	const char *to = mid + 1;
+	const char *end = strchr(to, delim);
+	if(end == NULL) end = to + strlen(to);
+	else if(end[1]) return batch_fail(b, "text after replace");
+
+	if(!batch_pattern(b, from, mid - from)) return false;
+	struct replace_match *m;
+	long n = replace_collect(&m);
+	batch_unescape(b, to, end - to);
+	if(n > 0) replace_rows(m, n, b->arg.buf, b->arg.len);
+	xfree(m);
+
+	erow *row = editor_row(St.cx);
+	if(row && St.cy > row->size) St.cy = row->size;
+	return true;
+}
+
+bool batch_save(struct batch *b, const char *path){
+	if(*path == '\0') path = St.file_name;
+	if(path == NULL) return batch_fail(b, "save needs a file name");
+	if(strcmp(path, "-") == 0){
+		struct save_batch out = { .fd = STDOUT_FILENO };
+		editor_gap_close();
+		if(!save_rows(&out)) return batch_fail(b, "writing to stdout: %s", strerror(errno));
+		return true;
+	}
+	if(editor_write_file(path) < 0) return batch_fail(b, "saving %s: %s", path, strerror(errno));
+	if(path == St.file_name) St.modified = 0;
+	return true;
+}
+
+bool batch_run(struct batch *b, char *line){
+	char *arg = strchr(line, ' ');
+	if(arg) *arg++ = '\0';
+	else arg = line + strlen(line);
+
+	if(strcmp(line, "goto") == 0) return batch_goto(b, arg);
+	if(strcmp(line, "insert") == 0){
+		batch_unescape(b, arg, strlen(arg));
+		editor_insert_text_at_cursor(b->arg.buf, b->arg.len);
+		return true;
+	}
+	if(strcmp(line, "delete") == 0){
+		long n = 1;
+		if(*arg && (!batch_number((const char **)&arg, &n) || *arg))
+			return batch_fail(b, "delete takes a count");
+		batch_delete(n);
+		return true;
+	}
+	if(strcmp(line, "find") == 0){
+		if(!batch_pattern(b, arg, strlen(arg))) return false;
+		batch_find();
+		return true;
+	}
+	if(strcmp(line, "replace") == 0) return batch_replace(b, arg);
+	if(strcmp(line, "regex") == 0){
+		if(strcmp(arg, "on") && strcmp(arg, "off")) return batch_fail(b, "regex takes on or off");
+		St.search.regex = strcmp(arg, "on") == 0;
+		return true;
+	}
+	if(strcmp(line, "save") == 0) return batch_save(b, arg);
+	return batch_fail(b, "unknown command %s", line);
+}
+
+/* Returns the exit status. */
+int editor_batch(const char *script, const char *filename){
+	init_editor_state();
+	St.screen_rows = 0;
+	if(filename) editor_open(filename);
+
+	int fd = ( strcmp(script, "-") == 0 ? STDIN_FILENO : open(script, O_RDONLY) );
+	long len;
+	char *text = ( fd == -1 ? NULL : batch_read(fd, &len) );
+	if(text == NULL){
+		fprintf(stderr, "%s: %s\n", script, strerror(errno));
+		return 1;
+	}
+	if(fd != STDIN_FILENO) close(fd);
+
+	struct batch b = { .script = script, .line = 0, .arg = { NULL, 0, 0 } };
+	bool ok = true;
+	for(char *line = text, *next; ok && line < text + len; line = next){
+		char *nl = memchr(line, '\n', text + len - line);
+		next = ( nl ? nl + 1 : text + len );
+		char *end = ( nl ? nl : text + len );
+		if(end > line && end[-1] == '\r') end--;
+		*end = '\0';
+		b.line++;
+		if(*line == '\0' || *line == '#') continue;
+		ok = batch_run(&b, line);
+	}
+	xfree(b.arg.buf);
+	xfree(text);
+	return ok ? 0 : 1;
+}
+
+/* --- memory stats --- */
+
+/* Heap taken by a malloc() of n bytes with glibc: a size word, rounded up
+ * to 16 bytes, 32 at the least. */
+long malloc_footprint(long n){
+	long chunk = (n + sizeof(size_t) + 15) & ~15L;
+	return chunk < 32 ? 32 : chunk;
+}
+
+/* Loads a file, gives every line its own copy of its text as if it had
+ * been typed or pasted, renders all of them, and prints the heap the rows
+ * take. "separate" is what the same rows took when each had its own
+ * malloc for characters, render and a byte of hl per cell, in a 120 byte
+ * erow; "arena" is the current layout. The mapped file itself is not
+ * counted. */
+void editor_mem_stats(const char *filename){
+	const long separate_erow = 120;
+	init_editor_state();
+	St.screen_rows = 0;
+	editor_open(filename);
+
+	long pieces = 0, bytes = 0, aliased = 0, with_hl = 0, indexed = 0;
+	long sep_text = 0, sep_render = 0, sep_hl = 0, sep_index = 0;
+	long render = 0, hl = 0, index = 0;
+	for(long x = 0; x < St.num_rows; x++){
+		editor_row_own(editor_row(x));
+		erow *row = editor_row_rendered(x);
+		bytes += row->size + 1;
+
+		sep_text += malloc_footprint(row->size + 1);
+		sep_render += malloc_footprint(row->rsize + 1);
+		sep_hl += malloc_footprint(row->rsize);
+		if(row->size >= ROW_CHECKPOINT_STRIDE)
+			sep_index += malloc_footprint(sizeof(struct row_checkpoint) * (row->size / ROW_CHECKPOINT_STRIDE + 1));
+
+		if(row->render_alias) aliased++;
+		else render += malloc_footprint(row->rsize + 1);
+		if(row->hl){
+			with_hl++;
+			hl += malloc_footprint(hl_bytes(row->rsize));
+		}
+		if(row->index){
+			indexed++;
+			index += malloc_footprint(sizeof(struct row_index)) +
+				malloc_footprint(sizeof(struct row_checkpoint) * (row->size / ROW_CHECKPOINT_STRIDE + 1));
+		}
+	}
+	struct row_iter it;
+	for(bool more = row_iter_seek(&it, 0); more; more = row_iter_seek(&it, it.at + it.piece->lines - it.offset))
+		pieces++;
+
+	long sep_rows = pieces * malloc_footprint(separate_erow * ROW_PIECE_MAX);
+	long rows = pieces * malloc_footprint(sizeof(erow) * ROW_PIECE_MAX);
+	long text = St.text.slabs * malloc_footprint(TEXT_SLAB_SIZE) + St.text.big;
+	long sep_total = sep_rows + sep_text + sep_render + sep_hl + sep_index;
+	long total = rows + text + render + hl + index;
+	double lines = ( St.num_rows ? St.num_rows : 1 );
+
+	printf("%s: %ld lines, %ld bytes of text\n", filename, St.num_rows, bytes);
+	printf("%ld rows render as their own text, %ld have hl, %ld have checkpoints\n\n",
+			aliased, with_hl, indexed);
+	printf("%-12s %14s %14s\n", "", "separate", "arena");
+	printf("%-12s %14ld %14ld\n", "erows", sep_rows, rows);
+	printf("%-12s %14ld %14ld\n", "text", sep_text, text);
+	printf("%-12s %14ld %14ld\n", "render", sep_render, render);
+	printf("%-12s %14ld %14ld\n", "hl", sep_hl, hl);
+	printf("%-12s %14ld %14ld\n", "checkpoints", sep_index, index);
+	printf("%-12s %14ld %14ld\n", "total", sep_total, total);
+	printf("%-12s %14.1f %14.1f\n", "bytes/line", sep_total / lines, total / lines);
+}
+
 /* --- main --- */
 
+#ifndef SEDIT_NO_MAIN
 int main(int argc, char *argv[])
 {
+	if(argc >= 3 && strcmp(argv[1], "--mem-stats") == 0){
+		editor_mem_stats(argv[2]);
+		return 0;
+	}
+	if(argc >= 3 && strcmp(argv[1], "--batch") == 0)
+		return editor_batch(argv[2], ( argc >= 4 ? argv[3] : NULL ));
+
 	enable_raw_mode();
 	init_editor();
 
 	if(argc >= 2) editor_open(argv[1]);
+	St.undo.on = true;
+	if(argc >= 2) journal_recover();
 
-	editor_set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = search");
+	editor_set_status_message("HELP: ^S save | ^Q quit | ^F find | ^R replace | ^Z/^Y undo/redo | ^D stats");
 
 	while(1){
 		editor_refresh_screen();
@@ -1169,3 +6243,4 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
+#endif
@@ -0,0 +1,134 @@
+/* Checks that comment highlighting kept up incrementally while editing
+ * matches what rendering every row again from the top gives. Keys are fed
+ * to editor_process_keypress() through a pipe standing in for the
+ * terminal, with a frame drawn after each, and then every row that is
+ * rendered has its comment state compared with a render from scratch.
+ * Prints the cases that fail and exits 1 if any did. */
+
+#define SEDIT_NO_MAIN
+#include "../sedit.c"
+
+#include <sys/wait.h>
+
+#define TEST_SCREEN_ROWS 20
+#define TEST_SCREEN_COLS 80
+
+struct test_case{
+	const char *name;
+	const char *file;     // each line of it repeated `repeat` times after the first
+	long repeat;
+	const char *keys;
+};
+
+struct test_case test_cases[] = {
+	// a paste that closes the comment, partly past the bottom of the screen
+	{ "paste_closing_comment", "/*\nx\n", 300,
+		"\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B"
+		"\x1b[200~*/\n1\n2\n3\n4\n5\n6\x1b[201~" },
+	{ "paste_then_scroll", "/*\nx\n", 300,
+		"\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B"
+		"\x1b[200~*/\n1\n2\n3\n4\n5\n6\x1b[201~\x1b[6~\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B" },
+	// reopening it from the top after the rows below were drawn closed
+	{ "paste_then_reopen", "/*\nx\n", 300,
+		"\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B\x1b[B"
+		"\x1b[200~*/\n1\n2\n3\n4\n5\n6\x1b[201~\x1b[6~\x1b[5~\x1b[5~\x1b[200~/*\n\x1b[201~\x1b[6~\x1b[6~" },
+};
+
+#define TEST_CASES (sizeof(test_cases) / sizeof(test_cases[0]))
+
+void test_write_file(const struct test_case *t, const char *path){
+	FILE *out = fopen(path, "w");
+	if(out == NULL) die(path);
+	const char *rest = strchr(t->file, '\n') + 1;
+	fwrite(t->file, 1, rest - t->file, out);
+	for(long x = 0; x < t->repeat; x++) fputs(rest, out);
+	if(fclose(out) != 0) die(path);
+}
+
+/* Hands the editor keys and runs it until it has taken all of them,
+ * drawing a frame after each. */
+void test_replay(int to_editor, int from_keys, const char *keys){
+	if(write_all(to_editor, keys, strlen(keys)) == -1) die("write");
+	while(1){
+		int queued = 0;
+		if(St.input.len == 0 && (ioctl(from_keys, FIONREAD, &queued) == -1 || queued == 0)) break;
+		editor_process_keypress();
+		editor_refresh_screen();
+	}
+}
+
+/* Runs t and returns the number of rows whose comment state is off. */
+long test_run(const struct test_case *t, const char *path){
+	int keys[2];
+	if(pipe(keys) == -1 || dup2(keys[0], STDIN_FILENO) == -1) die("pipe");
+	int null = open("/dev/null", O_WRONLY);
+	if(null == -1 || dup2(null, STDOUT_FILENO) == -1) die("/dev/null");
+	close(null);
+
+	init_editor_state();
+	St.screen_rows = TEST_SCREEN_ROWS;
+	St.screen_cols = TEST_SCREEN_COLS;
+	editor_init_events();
+	screen_init_sgr();
+	editor_open(path);
+	editor_refresh_screen();
+	test_replay(keys[1], keys[0], t->keys);
+
+	// what the editor would draw for each row it has rendered
+	unsigned gen = St.rc.render_gen;
+	signed char *start = malloc(St.num_rows), *open_comment = malloc(St.num_rows);
+	if(start == NULL || open_comment == NULL) die("malloc");
+	for(long x = 0; x < St.num_rows; x++){
+		erow *row = editor_row_peek(x);
+		start[x] = open_comment[x] = -1;
+		if(row == NULL || row->gen != gen) continue;
+		row = editor_row_rendered(x);
+		start[x] = row->hl_start_state;
+		open_comment[x] = row->hl_open_comment;
+	}
+
+	St.rc.render_gen++;
+	St.hl_dirty_from = LONG_MAX;
+	St.hl_dirty_to = -1;
+	long wrong = 0;
+	for(long x = 0; x < St.num_rows; x++){
+		erow *row = editor_row_rendered(x);
+		if(start[x] < 0 || (start[x] == row->hl_start_state && open_comment[x] == row->hl_open_comment)) continue;
+		if(wrong++ == 0) fprintf(stderr, "%s: row %ld starts in state %d, not %d\n", t->name, x, start[x], row->hl_start_state);
+	}
+	free(start);
+	free(open_comment);
+	close(keys[0]);
+	close(keys[1]);
+	return wrong;
+}
+
+int main(){
+	const char *tmp = getenv("TMPDIR");
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/sedit-test-XXXXXX.c", tmp ? tmp : "/tmp");
+	int fd = mkstemps(path, 2);
+	if(fd == -1) die("mkstemps");
+	close(fd);
+
+	// stdout is the frames' null sink, so results go out on a copy
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	if(out == NULL) die("fdopen");
+
+	int status = 0;
+	for(unsigned k = 0; k < TEST_CASES; k++){
+		test_write_file(test_cases + k, path);
+		pid_t pid = fork();
+		if(pid == -1) die("fork");
+		if(pid == 0) _exit(test_run(test_cases + k, path) > 0);
+		int child;
+		bool ok = waitpid(pid, &child, 0) != -1 && WIFEXITED(child) && WEXITSTATUS(child) == 0;
+		fprintf(out, "%s\t%s\n", test_cases[k].name, ( ok ? "ok" : "FAIL" ));
+		if(!ok) status = 1;
+		char *journal = journal_path(path);
+		unlink(journal);
+		free(journal);
+	}
+	unlink(path);
+	return status;
+}